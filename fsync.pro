@@ -21,12 +21,39 @@ SOURCES	+= fsyncwindow.cpp \
     ftree.cpp \
     main.cpp \
     applyworker.cpp \
-    analyzeworker.cpp
+    analyzeworker.cpp \
+    journal.cpp \
+    plan.cpp \
+    filter.cpp \
+    watchworker.cpp \
+    ratelimiter.cpp \
+    filecopier.cpp \
+    streamfile.cpp \
+    snapshot.cpp \
+    digeststore.cpp \
+    chunker.cpp \
+    chunkstore.cpp \
+    dedupworker.cpp \
+    benchmark.cpp
 
 HEADERS	+= fsyncwindow.h \
     ftree.h \
     applyworker.h \
-    analyzeworker.h
+    analyzeworker.h \
+    journal.h \
+    plan.h \
+    filter.h \
+    watchworker.h \
+    ratelimiter.h \
+    filecopier.h \
+    streamfile.h \
+    snapshot.h \
+    digeststore.h \
+    chunker.h \
+    chunkstore.h \
+    dedupworker.h \
+    benchmark.h \
+    varint.h
 
 FORMS	+= fsyncwindow.ui
 
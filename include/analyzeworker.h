@@ -16,8 +16,12 @@
 #define ANALYZEWORKER_H
 
 #include <QFileInfo>
+#include <QList>
 #include <QString>
 #include <QThread>
+#include <QVector>
+#include "digeststore.h"
+#include "filter.h"
 #include "ftree.h"
 
 class AnalyzeWorker : public QThread
@@ -25,7 +29,9 @@ class AnalyzeWorker : public QThread
     Q_OBJECT
 
     public:
-        AnalyzeWorker(Ftree*);
+        AnalyzeWorker(const QList<Ftree*>&, const Filter*);
+
+        void compare(const QList<Ftree*>&, bool = true);
 
     public slots:
         void cancelWork();
@@ -34,12 +40,14 @@ class AnalyzeWorker : public QThread
         void itemChanged(QString);
 
     private:
-        Ftree* root;
+        QList<Ftree*> roots;
+        const Filter* filter;
+        DigestStore digests;
         bool cancel;
 
         void run();
-        void compare(Ftree*);
-        bool compareFiles(const QFileInfo&, const QFileInfo&);
+        void exclude(std::list<QFileInfo>*, const QString&);
+        QVector<bool> compareFiles(const QFileInfo&, const QList<QFileInfo>&);
 };
 
 #endif
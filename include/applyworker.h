@@ -16,16 +16,29 @@
 #define APPLYWORKER_H
 
 #include <QDir>
+#include <QList>
 #include <QString>
 #include <QThread>
+#include "digeststore.h"
+#include "filecopier.h"
+#include "filter.h"
 #include "ftree.h"
+#include "journal.h"
 
+// Applies the changes of trees sharing the same master folder: the master
+// is walked once and each file is read once, whatever the number of
+// destinations needing it. With snapshot folders, the changes are applied
+// to a new folder instead of the slaves, whose unchanged files are
+// hardlinked into it
 class ApplyWorker : public QThread
 {
     Q_OBJECT
 
     public:
-        ApplyWorker(Ftree*);
+        ApplyWorker(const QList<Ftree*>&, const Filter*);
+
+        void setSnapshots(const QList<QDir>&);
+        void apply(const QList<Ftree*>&);
 
     public slots:
         void cancelWork();
@@ -33,14 +46,42 @@ class ApplyWorker : public QThread
     signals:
         void itemChanged(QString);
         void progressed();
+        void failed(QString);
 
     private:
-        Ftree* root;
+        // A slave folder to update from its node, or to copy entirely
+        // when it has none. Counted entries are part of the changes and
+        // report their progress
+        struct Target {
+            Journal* journal;
+            Ftree* node;
+            QDir dir;
+            bool counted;
+        };
+
+        struct Destination {
+            Journal* journal;
+            QString path;
+            bool counted;
+        };
+
+        QList<Ftree*> roots;
+        const Filter* filter;
+        QList<Journal*> journals;
+        QList<QDir> snapshots;
+        DigestStore digests;
+        FileCopier copier;
         bool cancel;
 
         void run();
-        void apply(Ftree*);
-        void copyDir(const QDir&, const QDir&);
+        void apply(const QDir&, const QList<Target>&);
+        void copyFile(const QString&, const QList<Destination>&);
+        void linkUnchanged(Ftree*, const QDir&);
+        void linkFile(const QString&, const QString&);
+        QString completedPath(const QString&) const;
+
+        static bool isDone(Journal*, Journal::Operation, const QString&);
+        static void record(Journal*, Journal::Operation, const QString&);
 };
 
 #endif
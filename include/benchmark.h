@@ -0,0 +1,39 @@
+/*Copyright 2017 Pierre Franco
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <QDir>
+#include <QString>
+#include <QStringList>
+#include <QTextStream>
+
+// Benchmarks run headless with --benchmark on synthetic data, reporting on
+// the standard output. Those needing files work in a scratch folder given
+// on the command line, and remove what they created.
+class Benchmark {
+    public:
+        static bool run(const QString&, const QStringList&, QString* = nullptr);
+
+    private:
+        static void filter(QTextStream&);
+        static bool stream(const QDir&, QTextStream&, QString*);
+        static bool dedup(const QDir&, QTextStream&, QString*);
+
+        static QStringList syntheticRules(int, bool);
+        static QStringList syntheticPaths(int);
+};
+
+#endif // BENCHMARK_H
@@ -0,0 +1,34 @@
+/*Copyright 2017 Pierre Franco
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+#ifndef CHUNKER_H
+#define CHUNKER_H
+
+#include <QtGlobal>
+
+// Content-defined chunking (FastCDC): chunk boundaries are found with a
+// gear rolling hash, so that an insertion only changes the chunks around
+// it. A stricter mask below the average size and a looser one above it
+// keep chunk sizes close to the average.
+class Chunker {
+    public:
+        enum { MinSize = 16*1024, AverageSize = 64*1024, MaxSize = 256*1024 };
+
+        static int cut(const uchar*, int);
+
+    private:
+        static const quint64* gear();
+};
+
+#endif // CHUNKER_H
@@ -0,0 +1,81 @@
+/*Copyright 2017 Pierre Franco
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+#ifndef CHUNKSTORE_H
+#define CHUNKSTORE_H
+
+#include <QByteArray>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QHash>
+#include <QList>
+#include <QString>
+
+// Deduplicated destination: every unique chunk is appended once to a pack
+// file and located through an index of SHA-1 digests, and each backed-up
+// file is a manifest listing its chunks, in a folder tree mirroring the
+// source. Chunks and index records are committed by batches: the pack is
+// synced first, then the records are appended and synced, so a record is
+// never on disk before its chunk. A manifest is only published once its
+// chunks are committed.
+class ChunkStore {
+    public:
+        struct Manifest {
+            qint64 size;
+            qint64 modified;
+            int permissions;
+            QList<QByteArray> chunks;
+        };
+
+        ChunkStore(const QDir&);
+        ~ChunkStore();
+
+        bool open(bool, QString* = nullptr);
+        bool commit();
+        bool isCommitDue() const;
+
+        bool contains(const QByteArray&) const;
+        bool add(const QByteArray&, const char*, int);
+        bool read(const QByteArray&, QByteArray&);
+
+        QDir manifests() const;
+        bool restore(const QDir&, QString* = nullptr);
+
+        static bool isStore(const QDir&);
+        static bool readManifest(const QString&, Manifest&);
+        static bool writeManifest(const QString&, const Manifest&);
+        static bool publishManifest(const QString&);
+        static QString publishedName(const QString&);
+        bool syncManifests();
+
+    private:
+        struct Location {
+            quint64 offset;
+            quint64 length;
+        };
+
+        QDir root;
+        QFile pack, index;
+        QHash<QByteArray, Location> locations;
+        QByteArray batch;
+        int batchCount;
+        quint64 packEnd, committedEnd;
+        QElapsedTimer lastCommit;
+
+        bool load(bool, QString*);
+        bool restoreDir(const QDir&, const QDir&, QString*);
+};
+
+#endif // CHUNKSTORE_H
@@ -0,0 +1,92 @@
+/*Copyright 2017 Pierre Franco
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+#ifndef DEDUPWORKER_H
+#define DEDUPWORKER_H
+
+#include <QByteArray>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QList>
+#include <QSemaphore>
+#include <QString>
+#include <QThread>
+#include <QThreadPool>
+#include <QVector>
+#include "chunkstore.h"
+#include "filter.h"
+
+// Back-up to a deduplicated store. Files are read once, in segments, by a
+// pipeline of three stages: the next segment is read and cut into chunks
+// while the chunks of the previous one are hashed by the thread pool, and
+// the hashed ones are appended to the store by a single writer thread.
+// Files whose manifest still matches their size and time are skipped,
+// manifests of removed files are deleted.
+class DedupWorker : public QThread
+{
+    Q_OBJECT
+
+    public:
+        DedupWorker(const QDir&, const QDir&, const Filter*);
+
+    public slots:
+        void cancelWork();
+
+    signals:
+        void itemChanged(QString);
+        void failed(QString);
+        void stored(qint64, qint64);
+
+    private:
+        friend class WriteTask;
+
+        // Read state is set before the last segment of the file is queued,
+        // write state is only touched by the writer
+        struct File {
+            QString source, path;
+            ChunkStore::Manifest manifest;
+            bool valid, failed;
+        };
+
+        struct Segment {
+            File* file;
+            QByteArray data;
+            QVector<int> ends;
+            QVector<QByteArray> digests;
+            QSemaphore hashed;
+            int tasks;
+            bool last;
+        };
+
+        QDir master;
+        ChunkStore store;
+        const Filter* filter;
+        QThreadPool pool, writer;
+        QSemaphore queued;
+        QList<File*> pending;
+        QElapsedTimer lastPublish;
+        qint64 readBytes, newBytes;
+        bool cancel;
+
+        void run();
+        void storeDir(const QDir&, const QDir&);
+        void storeFile(const QFileInfo&, const QString&);
+        void hash(Segment*);
+        void write(Segment*);
+        bool storeChunks(const Segment&, ChunkStore::Manifest&);
+        void publish(bool);
+};
+
+#endif // DEDUPWORKER_H
@@ -0,0 +1,65 @@
+/*Copyright 2017 Pierre Franco
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+#ifndef DIGESTSTORE_H
+#define DIGESTSTORE_H
+
+#include <QByteArray>
+#include <QDir>
+#include <QFileInfo>
+#include <QHash>
+#include <QString>
+
+// Digests of the files hashed while being copied from a master folder,
+// for both the source and the destination files, with the size and
+// modification time they had. A file whose size and time still match is
+// known by its digest and does not need to be read again. Entries are
+// appended, and compacted on loading once most of them are stale.
+//
+// A destination is recorded with the digest of the source stream written
+// to it. Only with verification was that digest checked against what
+// reached the disk; otherwise the entry trusts the write as the rest of
+// the back-up does.
+class DigestStore {
+    public:
+        DigestStore(const QDir&);
+        ~DigestStore();
+
+        void load();
+        void commit();
+
+        QByteArray lookup(const QFileInfo&) const;
+        void record(const QFileInfo&, const QByteArray&);
+        void record(const QString&, const QFileInfo&, const QByteArray&);
+
+        static QString location(const QDir&);
+
+    private:
+        struct Entry {
+            qint64 size;
+            qint64 modified;
+            QByteArray digest;
+        };
+
+        QString path;
+        QHash<QString, Entry> entries;
+        QByteArray batch;
+        bool loaded;
+
+        void compact();
+
+        static void append(QByteArray&, const QString&, const Entry&);
+};
+
+#endif // DIGESTSTORE_H
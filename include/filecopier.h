@@ -0,0 +1,52 @@
+/*Copyright 2017 Pierre Franco
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+#ifndef FILECOPIER_H
+#define FILECOPIER_H
+
+#include <QAtomicInt>
+#include <QByteArray>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+
+// Copies file contents by chunks, so that the traffic goes through the
+// rate limiter and the cache-conscious streaming of StreamFile. A source
+// can be copied to several destinations at once, it is then read a single
+// time. The source is hashed while it streams through, and destinations
+// can be verified by reading them back from the disk.
+class FileCopier {
+    public:
+        FileCopier();
+        ~FileCopier();
+
+        bool copy(const QString&, const QString&);
+        QVector<bool> copy(const QString&, const QStringList&);
+        const QByteArray& digest() const;
+
+        static void setVerify(bool);
+
+    private:
+        static QAtomicInt verify;
+
+        char* buffer;
+        QByteArray sourceDigest;
+
+        FileCopier(const FileCopier&);
+        FileCopier& operator=(const FileCopier&);
+
+        static QByteArray hash(const QString&, char*, bool);
+};
+
+#endif // FILECOPIER_H
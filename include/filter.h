@@ -0,0 +1,82 @@
+/*Copyright 2017 Pierre Franco
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <QList>
+#include <QMultiHash>
+#include <QRegularExpression>
+#include <QString>
+#include <QStringList>
+#include <QStringRef>
+#include <QVector>
+
+// Exclusion rules, matched against paths relative to the synchronized
+// folders. Rules use the .gitignore syntax: "!" re-includes, a trailing
+// "/" only matches folders, a leading or inner "/" anchors the rule to the
+// root and "**" crosses folders. A rule starting with "re:" is a regular
+// expression searched in the relative path. The last matching rule wins.
+class Filter {
+    public:
+        Filter();
+        Filter(const QStringList&);
+
+        bool isEmpty() const;
+        const QStringList& getRules() const;
+        const QStringList& getErrors() const;
+
+        bool excludes(const QString&, bool) const;
+
+    private:
+        struct Literal {
+            QString text;
+            int rule;
+        };
+
+        // Rules made of a literal and at most one leading or trailing "*"
+        // are looked up by hash, one probe for each literal length. Tables
+        // are keyed by the hash of the literal, so that the names and
+        // their ends are probed through references, without copies.
+        typedef QMultiHash<uint, Literal> Literals;
+
+        struct Table {
+            Literals names, prefixes, suffixes;
+            QList<int> prefixLengths, suffixLengths;
+        };
+
+        struct Pattern {
+            int rule;
+            bool dirOnly, glob;
+            QRegularExpression regex;
+        };
+
+        QStringList rules, errors;
+        QVector<bool> negated;
+        Table tables[2];
+        QList<Pattern> patterns;
+        QList<QRegularExpression> expressions;
+        QRegularExpression automaton[2];
+        bool hasNegation, empty;
+
+        void compile(int, QString);
+        void build();
+        int lookup(const Table&, const QStringRef&) const;
+
+        static int find(const Literals&, const QStringRef&);
+        static void insert(Literals&, QList<int>*, const QString&, int);
+        static QString globToRegex(const QString&);
+};
+
+#endif // FILTER_H
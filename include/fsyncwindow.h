@@ -16,12 +16,14 @@
 #define FSYNCWINDOW_H
 
 #include <QLineEdit>
+#include <QList>
 #include <QProgressBar>
 #include <QTableWidget>
 #include <QTableWidgetItem>
 #include <QTimer>
 #include <QWidget>
 
+#include "filter.h"
 #include "ftree.h"
 
 namespace Ui {
@@ -36,6 +38,13 @@ class FsyncWindow : public QWidget
         explicit FsyncWindow(QWidget *parent = 0);
         ~FsyncWindow();
 
+        void setFolders(const QString&, const QStringList&);
+        void setExcludeRules(const QStringList&);
+        void setThrottle(int, int, bool);
+        void setSnapshotMode(bool);
+        void setCacheMode(bool, bool);
+        void setVerify(bool);
+
     public slots:
         void browseSourceFolder();
         void browseSaveFolder();
@@ -44,9 +53,23 @@ class FsyncWindow : public QWidget
         void endAnalyze();
         void save();
         void endSave();
+        void watch();
+        void endWatch();
+        void watchSynchronized();
+        void dedup();
+        void endDedup();
+        void dedupStored(qint64, qint64);
         void cancelAnalyze();
         void cancelSave();
+        void cancelWatch();
+        void cancelDedup();
+        void savePlan();
+        void loadPlan();
 
+        void updateThrottle();
+        void updateCacheMode();
+        void updateVerify();
+        void addFailure(const QString&);
         void incrProgress();
         void setCurrentItem(const QString&);
 
@@ -58,14 +81,24 @@ class FsyncWindow : public QWidget
     private:
         QTimer* timer;
         Ui::FsyncWindow *ui;
-        Ftree* root;
+        QList<Ftree*> roots;
+        Filter filter;
+        QString planPath;
+        bool snapshots;
+        QList<QDir> snapshotDirs;
+        QStringList failures;
+        qint64 dedupRead, dedupNew;
         bool cancel;
         int time;
 
         void resetUi();
+        bool readSettings(QDir&, QList<QDir>&);
+        void setRoots(const QList<Ftree*>&);
+        int getChangeCount() const;
         void browseFolder(QLineEdit&, const char*);
         void addRow(QTableWidgetItem*, QTableWidgetItem*, QTableWidgetItem*);
-        void createTable(Ftree*);
+        void createTable(Ftree*, bool);
+        bool openPlan(const QStringList&);
 };
 
 #endif // FSYNCWINDOW_H
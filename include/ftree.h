@@ -18,17 +18,22 @@
 #include <list>
 #include <QDir>
 #include <QFileInfo>
+#include <QSharedPointer>
 
 class Ftree;
+class Plan;
 
 class Ftree {
     public:
         Ftree(const QDir&, const QDir&);
+        Ftree(const QDir&, const QDir&, QSharedPointer<const Plan>, quint64);
         ~Ftree();
 
         int getChangeCount();
 
         void addChild(Ftree*);
+        void removeChild(Ftree*);
+        void clearChanges();
         void setDirList(std::list<QFileInfo>*);
         void setFileList(std::list<QFileInfo>*);
         void setRemList(std::list<QFileInfo>*);
@@ -39,12 +44,19 @@ class Ftree {
         const std::list<QFileInfo>* getDirList() const;
         const std::list<QFileInfo>* getFileList() const;
         const std::list<QFileInfo>* getRemList() const;
+        bool isDamaged() const;
 
     private:
         QList<Ftree*> children;
         QDir master, slave;
 
         std::list<QFileInfo> *toAddDirs, *toAddFiles, *toRemove;
+
+        QSharedPointer<const Plan> plan;
+        quint64 planNode;
+        bool damaged;
+
+        void load() const;
 };
 
 #endif // FTREE_H
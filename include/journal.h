@@ -0,0 +1,64 @@
+/*Copyright 2017 Pierre Franco
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <QByteArray>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QSet>
+#include <QString>
+
+// Append-only log of the operations already applied to a slave folder.
+// Records are committed by batches: the slave filesystem is synced first,
+// then the batch is appended and synced, so a record is never on disk
+// before the data it describes.
+class Journal {
+    public:
+        enum Operation : quint8 {
+            Removed = 1,
+            DirCopied = 2,
+            FileCopied = 3
+        };
+
+        Journal(const QDir&, const QDir&);
+        ~Journal();
+
+        bool open();
+        void commit();
+        void finish();
+
+        bool isDone(Operation, const QString&) const;
+        void record(Operation, const QString&);
+
+        static QString location(const QDir&, const QDir&, const QString& = ".journal");
+        static bool pending(const QDir&, const QDir&);
+        static void discard(const QDir&, const QDir&);
+
+    private:
+        QDir slave;
+        QFile file;
+        QByteArray batch;
+        int batchCount;
+        QElapsedTimer lastCommit;
+        QSet<QByteArray> done;
+
+        QByteArray key(Operation, const QString&) const;
+        void load();
+        void syncSlave();
+};
+
+#endif // JOURNAL_H
@@ -0,0 +1,67 @@
+/*Copyright 2017 Pierre Franco
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+#ifndef PLAN_H
+#define PLAN_H
+
+#include <list>
+#include <QByteArray>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QList>
+#include <QSharedPointer>
+#include <QString>
+#include <QStringList>
+
+class Ftree;
+
+// Binary image of an analysis result. The file is memory-mapped and each
+// Ftree node is only decoded when it is first visited.
+//
+// Layout (little endian):
+//   header  "FSPL", u32 version, u64 pool offset, u64 pool size,
+//           u64 nodes offset, u64 root node, u64 change count,
+//           master path, slave path, exclusion rules (since version 2)
+//   pool    names, each a varint length followed by UTF-8 bytes
+//   nodes   written children first, each one: change count,
+//           dirs (names), files (names), removals (names),
+//           children (name, node offset)
+// Every number after the fixed header is a varint and names are pool
+// offsets, lists are prefixed by their length.
+class Plan : public QEnableSharedFromThis<Plan> {
+    public:
+        ~Plan();
+
+        static bool save(Ftree*, const QStringList&, const QString&);
+        static Ftree* load(const QString&, QStringList* = nullptr, QString* = nullptr);
+        static QString location(const QDir&, const QDir&);
+
+        int changeCount(quint64) const;
+        bool decode(quint64, Ftree*) const;
+
+    private:
+        QFile file;
+        QByteArray buffer;
+        const uchar* data;
+        quint64 size;
+        quint64 poolOffset, poolSize, nodesOffset;
+
+        Plan(const QString&);
+
+        bool read(quint64, const Ftree*, std::list<QFileInfo>*[3], QList<Ftree*>&) const;
+        bool name(quint64, QString&) const;
+};
+
+#endif // PLAN_H
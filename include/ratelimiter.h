@@ -0,0 +1,72 @@
+/*Copyright 2017 Pierre Franco
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+#ifndef RATELIMITER_H
+#define RATELIMITER_H
+
+#include <QAtomicInteger>
+#include <QElapsedTimer>
+#include <QMutex>
+
+// Token buckets shared by every worker, one for the bytes read and written
+// and one for the other operations (opening, listing, removing...).
+// Limits and the idle I/O priority can be changed while workers run. A
+// zero limit disables its bucket, and a disabled bucket only costs an
+// atomic load.
+class RateLimiter {
+    public:
+        static RateLimiter& instance();
+
+        void setLimits(qint64, qint64);
+        void setIdlePriority(bool);
+        void applyPriority();
+
+        inline void acquireBytes(qint64 bytes) {
+            checkPriority();
+            if (bytes > 0 && byteBucket.rate.loadAcquire() > 0)
+                acquire(byteBucket, bytes);
+        }
+
+        inline void acquireOps(qint64 ops = 1) {
+            checkPriority();
+            if (opBucket.rate.loadAcquire() > 0)
+                acquire(opBucket, ops);
+        }
+
+    private:
+        struct Bucket {
+            QAtomicInteger<qint64> rate;
+            double tokens, refilled;
+            qint64 last;
+        };
+
+        QMutex mutex;
+        QElapsedTimer clock;
+        Bucket byteBucket, opBucket;
+        QAtomicInt idle, priority;
+        static thread_local int appliedPriority;
+
+        RateLimiter();
+
+        inline void checkPriority() {
+            if (appliedPriority != priority.loadAcquire())
+                applyPriority();
+        }
+
+        void setRate(Bucket&, qint64, qint64);
+        void refill(Bucket&, qint64, qint64);
+        void acquire(Bucket&, qint64);
+};
+
+#endif // RATELIMITER_H
@@ -0,0 +1,34 @@
+/*Copyright 2017 Pierre Franco
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <QDir>
+#include <QString>
+
+// Snapshots kept in a destination folder, dated in UTC. A snapshot is
+// built in a ".partial" folder, analysed against the previous snapshot
+// whose unchanged files are hardlinked, and renamed once complete.
+class Snapshot {
+    public:
+        static QString previous(const QDir&);
+        static QString create(const QDir&);
+        static bool complete(const QDir&);
+        static QString completedPath(const QDir&);
+        static bool isPartial(const QDir&);
+        static void discardPartial(const QDir&);
+};
+
+#endif // SNAPSHOT_H
@@ -0,0 +1,61 @@
+/*Copyright 2017 Pierre Franco
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+#ifndef STREAMFILE_H
+#define STREAMFILE_H
+
+#include <QAtomicInt>
+#include <QFile>
+#include <QList>
+#include <QMutex>
+#include <QString>
+
+// File access of the copy and compare paths. In the cache-friendly mode
+// the kernel is told how files are read, pages are dropped once used and
+// written pages are flushed behind the writer, so that a back-up does not
+// evict the working set of everything else. Direct I/O bypasses the cache
+// altogether, it needs the aligned buffers handed out by the pool.
+// Uncached reads always come from the disk, to verify what was written.
+class StreamFile {
+    public:
+        enum Access { Sequential, Random, Uncached };
+        enum { BufferSize = 1024*1024, Alignment = 4096 };
+
+        StreamFile(const QString&);
+
+        static void setCacheMode(bool, bool);
+        static char* acquireBuffer();
+        static void releaseBuffer(char*);
+
+        bool open(QIODevice::OpenMode, Access = Sequential);
+        bool seek(qint64);
+        qint64 read(char*, qint64);
+        bool write(const char*, qint64);
+        bool finish();
+
+        QFile& file();
+
+    private:
+        static QAtomicInt dropMode, directMode;
+        static QMutex poolMutex;
+        static QList<char*> pool;
+
+        QFile handle;
+        bool dropCache, direct;
+        qint64 position, submitted, flushed;
+
+        void writeBehind(bool);
+};
+
+#endif // STREAMFILE_H
@@ -0,0 +1,43 @@
+/*Copyright 2017 Pierre Franco
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+#ifndef VARINT_H
+#define VARINT_H
+
+#include <QByteArray>
+
+// LEB128 encoding used by the on-disk formats (journal, plan)
+inline void appendVarint(QByteArray& out, quint64 value) {
+    while (value >= 0x80) {
+        out.append(char((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out.append(char(value));
+}
+
+inline bool readVarint(const uchar*& pos, const uchar* end, quint64& value) {
+    value = 0;
+
+    for (int shift = 0; pos < end && shift < 64; shift += 7) {
+        const uchar byte = *pos++;
+        value |= quint64(byte & 0x7f) << shift;
+
+        if (!(byte & 0x80))
+            return true;
+    }
+
+    return false;
+}
+
+#endif // VARINT_H
@@ -0,0 +1,79 @@
+/*Copyright 2017 Pierre Franco
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+#ifndef WATCHWORKER_H
+#define WATCHWORKER_H
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QList>
+#include <QSet>
+#include <QString>
+#include <QThread>
+#include "analyzeworker.h"
+#include "applyworker.h"
+#include "filter.h"
+#include "ftree.h"
+
+// Continuous synchronization: from the start of a full analysis and
+// back-up, changes in the source are followed with fanotify (when
+// permitted) or inotify, and only the folders they touched are compared
+// and applied again. Folders that could not be watched are rescanned
+// periodically.
+class WatchWorker : public QThread
+{
+    Q_OBJECT
+
+    public:
+        WatchWorker(const QList<Ftree*>&, const Filter*);
+
+    public slots:
+        void cancelWork();
+
+    signals:
+        void itemChanged(QString);
+        void synchronized();
+
+    private:
+        QList<Ftree*> roots;
+        const Filter* filter;
+        AnalyzeWorker analyzer;
+        ApplyWorker applier;
+        bool cancel;
+
+        int notifyFd, mountFd;
+        bool fanotify;
+        QHash<int, QString> watches;
+        QHash<QByteArray, QString> handles;
+        QSet<QString> unwatched;
+        QHash<QString, bool> dirty;
+        QElapsedTimer firstDirty, lastEvent;
+
+        void run();
+        bool initFanotify();
+        void initInotify();
+        void closeNotify();
+        void addWatches(const QString&);
+        void readEvents();
+        void readFanotify();
+        void readInotify();
+        bool isExcluded(const QString&, bool = true) const;
+        void markDirty(const QString&, bool);
+        void rescanUnwatched();
+        void sync();
+        Ftree* findNode(Ftree*, const QString&) const;
+};
+
+#endif
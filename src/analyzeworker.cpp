@@ -12,17 +12,31 @@
 *   See the License for the specific language governing permissions and
 *   limitations under the License.
 */
+#include <cstring>
 #include <queue>
 #include <vector>
-#include <QByteArray>
 #include <QDir>
-#include <QFile>
+#include <QHash>
+#include <QMap>
+#include <QSet>
 #include "analyzeworker.h"
+#include "ratelimiter.h"
+#include "streamfile.h"
 
 #define BUFFER_SIZE 4096
 #define BLOCK_CHECK 128
 
-AnalyzeWorker::AnalyzeWorker(Ftree* root) : root(root), cancel(false)
+static std::list<QFileInfo>::iterator findFile(std::list<QFileInfo>* list, const QString& name) {
+    for (auto it = list->begin(); it != list->end(); ++it) {
+        if (it->isFile() && it->fileName() == name)
+            return it;
+    }
+
+    return list->end();
+}
+
+AnalyzeWorker::AnalyzeWorker(const QList<Ftree*>& roots, const Filter* filter) :
+    roots(roots), filter(filter), digests(*roots.first()->getMaster()), cancel(false)
 {}
 
 void AnalyzeWorker::cancelWork() {
@@ -30,104 +44,251 @@ void AnalyzeWorker::cancelWork() {
 }
 
 void AnalyzeWorker::run() {
-    compare(root);
+    RateLimiter::instance().applyPriority();
+    compare(roots);
 }
 
-void AnalyzeWorker::compare(Ftree* tree) {
-    std::list<QFileInfo>* masterFileList = new std::list<QFileInfo>(
-            tree->getMaster()->entryInfoList(QDir::Files |
-                                 QDir::NoDotAndDotDot | QDir::NoSymLinks).toStdList());
-    std::list<QFileInfo>* masterDirList = new std::list<QFileInfo>(
-            tree->getMaster()->entryInfoList(QDir::Dirs |
-                                 QDir::NoDotAndDotDot | QDir::NoSymLinks).toStdList());
-    std::list<QFileInfo>* slaveList = new std::list<QFileInfo>(
-            tree->getSlave()->entryInfoList(QDir::Dirs | QDir::Files |
-                                QDir::NoDotAndDotDot | QDir::NoSymLinks).toStdList());
+// Every tree of the list has the same master folder, which is only listed
+// once. A tree compared again keeps the children of folders still present
+// on both sides, they are only compared again when recursive is set
+void AnalyzeWorker::compare(const QList<Ftree*>& trees, bool recursive) {
+    const QDir* master = trees.first()->getMaster();
+    QMap<QString, QList<Ftree*>> subtrees;
+    QString prefix;
+
+    digests.load();
+    RateLimiter::instance().acquireOps(2);
+    std::list<QFileInfo> masterFiles = master->entryInfoList(QDir::Files |
+                                 QDir::NoDotAndDotDot | QDir::NoSymLinks).toStdList();
+    std::list<QFileInfo> masterDirs = master->entryInfoList(QDir::Dirs |
+                                 QDir::NoDotAndDotDot | QDir::NoSymLinks).toStdList();
+
+    // Excluded entries are neither copied nor removed, and excluded
+    // folders are never opened
+    if (filter && !filter->isEmpty()) {
+        const QString path = roots.first()->getMaster()->relativeFilePath(master->absolutePath());
+
+        prefix = path.isEmpty() || path == "." ? QString() : path + "/";
+        exclude(&masterFiles, prefix);
+        exclude(&masterDirs, prefix);
+    }
+
+    QVector<std::list<QFileInfo>*> slaveLists;
+
+    for (auto tit = trees.begin(); tit != trees.end(); ++tit) {
+        RateLimiter::instance().acquireOps();
+        std::list<QFileInfo>* slaveList = new std::list<QFileInfo>(
+                (*tit)->getSlave()->entryInfoList(QDir::Dirs | QDir::Files |
+                                    QDir::NoDotAndDotDot | QDir::NoSymLinks).toStdList());
+
+        if (filter && !filter->isEmpty())
+            exclude(slaveList, prefix);
 
-    std::list<std::list<QFileInfo>::iterator> masterFileToRemove, masterDirToRemove;
+        slaveLists.append(slaveList);
+    }
+
+    // Each master file is read once, against its namesake in every
+    // destination
+    QVector<QVector<bool>> sameFiles;
+
+    for (auto mit = masterFiles.begin(); mit != masterFiles.end(); ++mit) {
+        QList<QFileInfo> candidates;
 
-    for (auto mit = masterFileList->begin(); mit != masterFileList->end(); ++mit) {
         emit itemChanged("Analysing file " + mit->absoluteFilePath());
 
-        for (auto sit = slaveList->begin(); sit != slaveList->end(); ++sit) {
-            if (cancel)
-                return;
-            if (sit->isFile() && compareFiles(*mit, *sit)) {
-                masterFileToRemove.push_back(mit);
-                slaveList->erase(sit);
-                break;
-            }
+        for (auto lit = slaveLists.begin(); lit != slaveLists.end(); ++lit) {
+            auto sit = findFile(*lit, mit->fileName());
+
+            candidates.append(sit == (*lit)->end() ? QFileInfo() : *sit);
         }
 
+        if (cancel)
+            break;
+
+        sameFiles.append(compareFiles(*mit, candidates));
     }
 
-    for (auto mit = masterDirList->begin(); mit != masterDirList->end(); ++mit) {
-        emit itemChanged("Analysing folder " + mit->absoluteFilePath());
-
-        for (auto sit = slaveList->begin(); sit != slaveList->end(); ++sit) {
-            if (cancel)
-                return;
-            if (sit->isDir() && mit->fileName() == sit->fileName()) {
-                Ftree* child = new Ftree(QDir(mit->absoluteFilePath()),
-                                         QDir(sit->absoluteFilePath()));
-                compare(child);
-                tree->addChild(child);
-                masterDirToRemove.push_back(mit);
-                slaveList->erase(sit);
-                break;
+    // Each tree is left as it was or fully compared, a canceled one keeps
+    // its previous lists and children
+    for (int t = 0; !cancel && t < trees.size(); ++t) {
+        Ftree* tree = trees.at(t);
+        QHash<QString, Ftree*> previous;
+        QSet<Ftree*> kept;
+        QList<Ftree*> added;
+
+        for (auto it = tree->getChildren()->begin(); it != tree->getChildren()->end(); ++it)
+            previous.insert((*it)->getMaster()->dirName(), *it);
+
+        std::list<QFileInfo>* masterFileList = new std::list<QFileInfo>(masterFiles);
+        std::list<QFileInfo>* masterDirList = new std::list<QFileInfo>(masterDirs);
+        std::list<QFileInfo>* slaveList = slaveLists.at(t);
+
+        std::list<std::list<QFileInfo>::iterator> masterFileToRemove, masterDirToRemove;
+        int index = 0;
+
+        for (auto mit = masterFileList->begin(); mit != masterFileList->end(); ++mit, ++index) {
+            if (sameFiles.at(index).at(t)) {
+                masterFileToRemove.push_back(mit);
+                slaveList->erase(findFile(slaveList, mit->fileName()));
             }
         }
-    }
 
-    for (auto it = masterFileToRemove.begin(); it != masterFileToRemove.end(); ++it) {
-        if (cancel)
-            return;
-        masterFileList->erase(*it);
+        for (auto mit = masterDirList->begin(); !cancel && mit != masterDirList->end(); ++mit) {
+            emit itemChanged("Analysing folder " + mit->absoluteFilePath());
+
+            for (auto sit = slaveList->begin(); !cancel && sit != slaveList->end(); ++sit) {
+                if (sit->isDir() && mit->fileName() == sit->fileName()) {
+                    Ftree* child = previous.value(mit->fileName(), nullptr);
+
+                    if (child) {
+                        if (recursive)
+                            subtrees[mit->fileName()].append(child);
+                        kept.insert(child);
+                    } else {
+                        child = new Ftree(QDir(mit->absoluteFilePath()),
+                                          QDir(sit->absoluteFilePath()));
+                        subtrees[mit->fileName()].append(child);
+                        added.append(child);
+                    }
+                    masterDirToRemove.push_back(mit);
+                    slaveList->erase(sit);
+                    break;
+                }
+            }
+        }
+
+        if (cancel) {
+            qDeleteAll(added);
+            delete masterFileList;
+            delete masterDirList;
+            break;
+        }
+
+        for (auto it = masterFileToRemove.begin(); it != masterFileToRemove.end(); ++it)
+            masterFileList->erase(*it);
+        for (auto it = masterDirToRemove.begin(); it != masterDirToRemove.end(); ++it)
+            masterDirList->erase(*it);
+
+        for (auto it = previous.begin(); it != previous.end(); ++it) {
+            if (!kept.contains(it.value()))
+                tree->removeChild(it.value());
+        }
+        for (auto it = added.begin(); it != added.end(); ++it)
+            tree->addChild(*it);
+
+        tree->setFileList(masterFileList);
+        tree->setDirList(masterDirList);
+        tree->setRemList(slaveList);
+        slaveLists[t] = nullptr;
     }
-    for (auto it = masterDirToRemove.begin(); it != masterDirToRemove.end(); ++it) {
+
+    // Only a cancel leaves destination lists not handed to their tree
+    qDeleteAll(slaveLists);
+
+    if (cancel)
+        return;
+
+    // Subfolders present in several destinations are still listed once
+    for (auto it = subtrees.begin(); it != subtrees.end(); ++it) {
         if (cancel)
             return;
-        masterDirList->erase(*it);
+        compare(it.value());
     }
+}
 
-    tree->setFileList(masterFileList);
-    tree->setDirList(masterDirList);
-    tree->setRemList(slaveList);
+void AnalyzeWorker::exclude(std::list<QFileInfo>* list, const QString& prefix) {
+    for (auto it = list->begin(); it != list->end();) {
+        if (filter->excludes(prefix + it->fileName(), it->isDir()))
+            it = list->erase(it);
+        else
+            ++it;
+    }
 }
 
-bool AnalyzeWorker::compareFiles(const QFileInfo& f1, const QFileInfo& f2) {
-    if (f1.fileName() != f2.fileName())
-        return false;
+// Compares a master file with a candidate copy in each destination (an
+// empty QFileInfo when there is none). The sampled blocks of the master
+// are read once and compared with every candidate still matching.
+QVector<bool> AnalyzeWorker::compareFiles(const QFileInfo& master, const QList<QFileInfo>& slaves) {
+    QVector<bool> same(slaves.size(), false);
+    QList<int> open;
+
+    // Files hashed by a previous copy and unchanged since are known
+    const QByteArray digest1 = digests.lookup(master);
 
-    if (f1.size() != f2.size())
-        return false;
+    for (int i = 0; i < slaves.size(); ++i) {
+        const QFileInfo& slave = slaves.at(i);
 
-    QFile f1Handle(f1.absoluteFilePath());
-    QFile f2Handle(f2.absoluteFilePath());
-    QByteArray buffer1, buffer2;
-    const int blockCount = (f1.size() + (BUFFER_SIZE - 1))/BUFFER_SIZE;
-    bool eq = true;
+        if (slave.fileName().isEmpty() || slave.size() != master.size())
+            continue;
 
-    if (!f1Handle.open(QIODevice::ReadOnly))
-        return false;
+        const QByteArray digest2 = digest1.isEmpty() ? QByteArray() : digests.lookup(slave);
 
-    if (!f2Handle.open(QIODevice::ReadOnly)) {
-        f1Handle.close();
-        return false;
+        if (!digest2.isEmpty())
+            same[i] = digest1 == digest2;
+        else
+            open.append(i);
     }
 
-    // Check first block
-    buffer1 = f1Handle.read(BUFFER_SIZE);
-    buffer2 = f2Handle.read(BUFFER_SIZE);
+    if (open.isEmpty())
+        return same;
+
+    StreamFile masterHandle(master.absoluteFilePath());
+    QList<StreamFile*> slaveHandles;
+    char* masterBuffer = StreamFile::acquireBuffer();
+    char* slaveBuffer = StreamFile::acquireBuffer();
+    const int blockCount = (master.size() + (BUFFER_SIZE - 1))/BUFFER_SIZE;
+    RateLimiter& limiter = RateLimiter::instance();
+
+    limiter.acquireOps(1 + open.size());
+
+    bool eq = masterHandle.open(QIODevice::ReadOnly, StreamFile::Random);
+
+    for (auto it = open.begin(); it != open.end(); ++it) {
+        StreamFile* handle = new StreamFile(slaves.at(*it).absoluteFilePath());
+
+        slaveHandles.append(handle);
+        same[*it] = eq && handle->open(QIODevice::ReadOnly, StreamFile::Random);
+    }
+
+    // Blocks are aligned so that they can be read directly. Candidates
+    // differing from the master are dropped, false once none is left.
+    auto sameBlock = [&](qint64 block) {
+        bool any = false;
 
-    if (buffer1 != buffer2)
-        eq = false;
+        limiter.acquireBytes(BUFFER_SIZE);
+
+        if (!masterHandle.seek(block))
+            return false;
+
+        const qint64 length1 = masterHandle.read(masterBuffer, BUFFER_SIZE);
+
+        for (int i = 0; i < open.size(); ++i) {
+            if (!same.at(open.at(i)))
+                continue;
+
+            StreamFile* handle = slaveHandles.at(i);
+
+            limiter.acquireBytes(BUFFER_SIZE);
+
+            const qint64 length2 = handle->seek(block) ? handle->read(slaveBuffer, BUFFER_SIZE) : -1;
+
+            if (length1 >= 0 && length1 == length2 && memcmp(masterBuffer, slaveBuffer, length1) == 0)
+                any = true;
+            else
+                same[open.at(i)] = false;
+        }
+
+        return any;
+    };
+
+    // Check first block
+    eq = eq && sameBlock(0);
 
     //Check some random blocks
     if (eq && blockCount > 2) {
         std::priority_queue<qint64, std::vector<qint64>, std::greater<qint64>> blockList;
 
-        qsrand(f1.size());
+        qsrand(master.size());
 
         int checkCount = (blockCount + BLOCK_CHECK - 1)/BLOCK_CHECK;
 
@@ -138,13 +299,7 @@ bool AnalyzeWorker::compareFiles(const QFileInfo& f1, const QFileInfo& f2) {
             block = blockList.top();
             blockList.pop();
 
-            f1Handle.seek(block);
-            f2Handle.seek(block);
-
-            buffer1 = f1Handle.read(BUFFER_SIZE);
-            buffer2 = f2Handle.read(BUFFER_SIZE);
-
-            if (buffer1 != buffer2) {
+            if (!sameBlock(block)) {
                 eq = false;
                 break;
             }
@@ -152,19 +307,12 @@ bool AnalyzeWorker::compareFiles(const QFileInfo& f1, const QFileInfo& f2) {
     }
 
     // Check last block
-    if (eq) {
-        f1Handle.seek((blockCount - 1)*BUFFER_SIZE);
-        f2Handle.seek((blockCount - 1)*BUFFER_SIZE);
-
-        buffer1 = f1Handle.read(BUFFER_SIZE);
-        buffer2 = f2Handle.read(BUFFER_SIZE);
-
-        if (buffer1 != buffer2)
-            eq = false;
-    }
+    if (eq && blockCount > 1)
+        sameBlock(qint64(blockCount - 1)*BUFFER_SIZE);
 
-    f1Handle.close();
-    f2Handle.close();
+    qDeleteAll(slaveHandles);
+    StreamFile::releaseBuffer(masterBuffer);
+    StreamFile::releaseBuffer(slaveBuffer);
 
-    return eq;
+    return same;
 }
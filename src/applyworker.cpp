@@ -12,70 +12,343 @@
 *   See the License for the specific language governing permissions and
 *   limitations under the License.
 */
+#include <cstdio>
+#include <QDateTime>
+#include <QFile>
+#include <QMap>
+#include <QSet>
 #include "applyworker.h"
+#include "ratelimiter.h"
+#include "snapshot.h"
 
-ApplyWorker::ApplyWorker(Ftree* root) : root(root), cancel(false)
+#ifdef Q_OS_UNIX
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define TEMP_SUFFIX ".fsync-part"
+
+ApplyWorker::ApplyWorker(const QList<Ftree*>& roots, const Filter* filter) :
+    roots(roots), filter(filter), digests(*roots.first()->getMaster()), cancel(false)
 {}
 
 void ApplyWorker::cancelWork() {
     cancel = true;
 }
 
+// Snapshots are never resumed, they have no journal
+void ApplyWorker::setSnapshots(const QList<QDir>& dirs) {
+    snapshots = dirs;
+}
+
 void ApplyWorker::run() {
-    apply(root);
+    RateLimiter::instance().applyPriority();
+
+    for (auto it = roots.begin(); it != roots.end(); ++it) {
+        Journal* log = snapshots.isEmpty() ? new Journal(*(*it)->getMaster(), *(*it)->getSlave()) : nullptr;
+
+        if (log && !log->open()) {
+            delete log;
+            log = nullptr;
+        }
+        journals.append(log);
+    }
+
+    apply(roots);
+
+    for (auto it = journals.begin(); it != journals.end(); ++it) {
+        if (*it && !cancel)
+            (*it)->finish();
+    }
+
+    qDeleteAll(journals);
+    journals.clear();
+    digests.commit();
+}
+
+// Journals are only kept while run() applies the roots
+void ApplyWorker::apply(const QList<Ftree*>& trees) {
+    QList<Target> targets;
+
+    for (int i = 0; i < trees.size(); ++i) {
+        const Target target = { journals.value(i, nullptr), trees.at(i),
+                                snapshots.value(i, *trees.at(i)->getSlave()), false };
+
+        targets.append(target);
+    }
+
+    if (!targets.isEmpty())
+        apply(*trees.first()->getMaster(), targets);
 }
 
-void ApplyWorker::apply(Ftree* tree) {
-    for (auto it = tree->getRemList()->begin(); it != tree->getRemList()->end(); ++it) {
+void ApplyWorker::apply(const QDir& master, const QList<Target>& targets) {
+    QMap<QString, QList<Target>> folders;
+    QMap<QString, QList<Destination>> files;
+    QList<Target> copies;
+    QFileInfoList entries;
+    bool listed = false;
+
+    for (auto it = targets.begin(); it != targets.end(); ++it) {
         if (cancel)
             return;
-        if (it->isDir()) {
-            emit itemChanged("Removing folder " + it->absoluteFilePath());
-            QDir(it->absoluteFilePath()).removeRecursively();
+
+        if (it->node) {
+            Ftree* tree = it->node;
+            const std::list<QFileInfo>* remList = tree->getRemList();
+
+            // Nothing more of a damaged plan is applied
+            if (tree->isDamaged()) {
+                cancel = true;
+                return;
+            }
+
+            // The slave is the previous snapshot when the changes go elsewhere
+            const bool snapshot = it->dir.absolutePath() != tree->getSlave()->absolutePath();
+
+            if (snapshot) {
+                RateLimiter::instance().acquireOps();
+                it->dir.mkpath(".");
+            }
+
+            for (auto rit = remList->begin(); rit != remList->end(); ++rit) {
+                if (cancel)
+                    return;
+                if (snapshot || isDone(it->journal, Journal::Removed, rit->absoluteFilePath())) {
+                    emit progressed();
+                    continue;
+                }
+                RateLimiter::instance().acquireOps();
+                if (rit->isDir()) {
+                    emit itemChanged("Removing folder " + rit->absoluteFilePath());
+                    QDir(rit->absoluteFilePath()).removeRecursively();
+                } else {
+                    //emit itemChanged("Suppression du fichier " + rit->absoluteFilePath());
+                    QFile(rit->absoluteFilePath()).remove();
+                }
+                record(it->journal, Journal::Removed, rit->absoluteFilePath());
+
+                emit progressed();
+            }
+
+            for (auto dit = tree->getDirList()->begin(); dit != tree->getDirList()->end(); ++dit) {
+                const Target folder = { it->journal, nullptr, QDir(it->dir.filePath(dit->fileName())), true };
+
+                folders[dit->fileName()].append(folder);
+            }
+
+            for (auto fit = tree->getFileList()->begin(); fit != tree->getFileList()->end(); ++fit) {
+                const Destination file = { it->journal, it->dir.filePath(fit->fileName()), true };
+
+                files[fit->fileName()].append(file);
+            }
+
+            for (auto cit = tree->getChildren()->begin(); cit != tree->getChildren()->end(); ++cit) {
+                const QString name = (*cit)->getMaster()->dirName();
+                const Target child = { it->journal, *cit, QDir(it->dir.filePath(name)), false };
+
+                folders[name].append(child);
+            }
+
+            if (snapshot)
+                linkUnchanged(tree, it->dir);
         } else {
-            //emit itemChanged("Suppression du fichier " + it->absoluteFilePath());
-            QFile(it->absoluteFilePath()).remove();
-        }
+            if (isDone(it->journal, Journal::DirCopied, it->dir.absolutePath())) {
+                if (it->counted)
+                    emit progressed();
+                continue;
+            }
+
+            // The master folder may have been removed since the analysis,
+            // it must not be created empty in the destination
+            if (!listed && !master.exists()) {
+                if (it->counted)
+                    emit progressed();
+                continue;
+            }
+
+            // The master folder is listed once for all the copies
+            if (!listed) {
+                const QString prefix = roots.first()->getMaster()->relativeFilePath(master.absolutePath()) + "/";
+
+                emit itemChanged("Copying folder " + master.absolutePath());
+                RateLimiter::instance().acquireOps();
+                entries = master.entryInfoList(QDir::Dirs | QDir::Files |
+                                               QDir::NoDotAndDotDot | QDir::NoSymLinks);
+
+                for (auto eit = entries.begin(); filter && eit != entries.end();) {
+                    if (filter->excludes(prefix + eit->fileName(), eit->isDir()))
+                        eit = entries.erase(eit);
+                    else
+                        ++eit;
+                }
+                listed = true;
+            }
+
+            RateLimiter::instance().acquireOps();
+            it->dir.mkpath(".");
+
+            for (auto eit = entries.begin(); eit != entries.end(); ++eit) {
+                if (eit->isDir()) {
+                    const Target folder = { it->journal, nullptr, QDir(it->dir.filePath(eit->fileName())), false };
+
+                    folders[eit->fileName()].append(folder);
+                } else {
+                    const Destination file = { it->journal, it->dir.filePath(eit->fileName()), false };
 
-        emit progressed();
+                    files[eit->fileName()].append(file);
+                }
+            }
+
+            copies.append(*it);
+        }
     }
 
-    for (auto it = tree->getDirList()->begin(); it != tree->getDirList()->end(); ++it) {
+    for (auto it = files.begin(); it != files.end(); ++it) {
         if (cancel)
             return;
-        copyDir(QDir(it->absoluteFilePath()), tree->getSlave()->filePath(it->fileName()));
+        //emit itemChanged("Copie du fichier " + master.filePath(it.key()));
+        copyFile(master.filePath(it.key()), it.value());
+    }
 
-        emit progressed();
+    for (auto it = folders.begin(); it != folders.end(); ++it) {
+        if (cancel)
+            return;
+        apply(QDir(master.filePath(it.key())), it.value());
     }
 
-    for (auto it = tree->getFileList()->begin(); it != tree->getFileList()->end(); ++it) {
+    // A copied folder is complete once everything below it is
+    for (auto it = copies.begin(); it != copies.end(); ++it) {
         if (cancel)
             return;
-        //emit itemChanged("Copie du fichier " + it->absoluteFilePath());
-        QFile::copy(it->absoluteFilePath(), tree->getSlave()->filePath(it->fileName()));
+        record(it->journal, Journal::DirCopied, it->dir.absolutePath());
+        if (it->counted)
+            emit progressed();
+    }
+}
+
+void ApplyWorker::copyFile(const QString& src, const QList<Destination>& dsts) {
+    QList<Destination> pending;
+    QStringList tmps;
+
+    // Never leave a partial file under the final name: copy next to it,
+    // then rename over the destination
+    for (auto it = dsts.begin(); it != dsts.end(); ++it) {
+        if (isDone(it->journal, Journal::FileCopied, it->path)) {
+            if (it->counted)
+                emit progressed();
+            continue;
+        }
 
-        emit progressed();
+        pending.append(*it);
+        tmps.append(it->path + TEMP_SUFFIX);
+        QFile::remove(tmps.last());
     }
 
-    for (auto it = tree->getChildren()->begin(); it != tree->getChildren()->end(); ++it)
-        apply(*it);
+    if (pending.isEmpty())
+        return;
+
+    const QFileInfo before(src);
+    const qint64 size = before.size();
+    const QDateTime modified = before.lastModified();
+    const QVector<bool> copied = copier.copy(src, tmps);
+    const QFileInfo after(src);
+
+    // A source changed while being copied has no reliable digest
+    const bool hashed = !copier.digest().isEmpty() && after.size() == size &&
+                        after.lastModified() == modified;
+
+    if (hashed)
+        digests.record(after, copier.digest());
+
+    for (int i = 0; i < pending.size(); ++i) {
+        const QString& tmp = tmps.at(i);
+        const QString& dst = pending.at(i).path;
+        bool renamed = false;
+
+        if (copied.at(i)) {
+            RateLimiter::instance().acquireOps();
+
+#ifdef Q_OS_UNIX
+            renamed = std::rename(QFile::encodeName(tmp).constData(),
+                                  QFile::encodeName(dst).constData()) == 0;
+#else
+            QFile::remove(dst);
+            renamed = QFile::rename(tmp, dst);
+#endif
+        }
+
+        if (renamed) {
+            record(pending.at(i).journal, Journal::FileCopied, dst);
+            if (hashed)
+                digests.record(completedPath(dst), QFileInfo(dst), copier.digest());
+        } else {
+            QFile::remove(tmp);
+            emit failed(dst);
+        }
+
+        if (pending.at(i).counted)
+            emit progressed();
+    }
 }
 
-void ApplyWorker::copyDir(const QDir& src, const QDir& dst) {
-    emit itemChanged("Copying folder " + src.absolutePath());
-    dst.mkpath(".");
+// Files of the previous snapshot not marked as removed by the analysis
+// are unchanged, folders are handled by the children of the node. Like
+// excluded folders, which have no node, excluded files are not carried
+// over: a snapshot only holds what the rules let in.
+void ApplyWorker::linkUnchanged(Ftree* tree, const QDir& dir) {
+    const QString path = roots.first()->getMaster()->relativeFilePath(tree->getMaster()->absolutePath());
+    const QString prefix = path.isEmpty() || path == "." ? QString() : path + "/";
+    QSet<QString> changed;
 
-    QFileInfoList fileList = src.entryInfoList(QDir::Dirs | QDir::Files |
-                                               QDir::NoDotAndDotDot | QDir::NoSymLinks);
+    for (auto it = tree->getRemList()->begin(); it != tree->getRemList()->end(); ++it)
+        changed.insert(it->fileName());
+
+    RateLimiter::instance().acquireOps();
+    const QFileInfoList fileList = tree->getSlave()->entryInfoList(QDir::Files |
+                                                                   QDir::NoDotAndDotDot | QDir::NoSymLinks);
 
     for (auto it = fileList.begin(); it != fileList.end(); ++it) {
         if (cancel)
             return;
-        if (it->isDir()) {
-            copyDir(QDir(it->absoluteFilePath()), dst.filePath(it->fileName()));
-        } else {
-            //emit itemChanged("Copie du fichier " + it->absoluteFilePath());
-            QFile::copy(it->absoluteFilePath(), dst.filePath(it->fileName()));
-        }
+        if (changed.contains(it->fileName()) || (filter && filter->excludes(prefix + it->fileName(), false)))
+            continue;
+        linkFile(it->absoluteFilePath(), dir.filePath(it->fileName()));
+    }
+}
+
+// Copies instead when the file cannot be linked (other filesystem, too
+// many links...), through a temporary name like any other copy
+void ApplyWorker::linkFile(const QString& src, const QString& dst) {
+    RateLimiter::instance().acquireOps();
+
+#ifdef Q_OS_UNIX
+    if (linkat(AT_FDCWD, QFile::encodeName(src).constData(),
+               AT_FDCWD, QFile::encodeName(dst).constData(), 0) == 0)
+        return;
+#endif
+
+    const Destination copy = { nullptr, dst, false };
+
+    copyFile(src, QList<Destination>() << copy);
+}
+
+// Files of a snapshot are known under their path once it is complete
+QString ApplyWorker::completedPath(const QString& path) const {
+    for (auto it = snapshots.begin(); it != snapshots.end(); ++it) {
+        const QString partial = it->absolutePath() + "/";
+
+        if (path.startsWith(partial))
+            return Snapshot::completedPath(*it) + "/" + path.mid(partial.size());
     }
+
+    return path;
+}
+
+bool ApplyWorker::isDone(Journal* journal, Journal::Operation op, const QString& path) {
+    return journal && journal->isDone(op, path);
+}
+
+void ApplyWorker::record(Journal* journal, Journal::Operation op, const QString& path) {
+    if (journal)
+        journal->record(op, path);
 }
@@ -0,0 +1,356 @@
+/*Copyright 2017 Pierre Franco
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+#include <cstring>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include "benchmark.h"
+#include "dedupworker.h"
+#include "filecopier.h"
+#include "filter.h"
+#include "streamfile.h"
+
+#ifdef Q_OS_LINUX
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define FILTER_PATHS 200000
+#define FILTER_ROUNDS 3
+#define STREAM_FILE_SIZE (1024*1024*1024LL)
+#define DEDUP_BASE_FILES 4
+#define DEDUP_FILE_SIZE (64*1024*1024)
+#define DEDUP_EDITS 10
+#define MEBI (1024*1024)
+
+// Small deterministic generator, so that runs can be compared
+static quint32 nextRandom(quint32& state) {
+    state = state * 1664525u + 1013904223u;
+    return state >> 8;
+}
+
+// Spreads the 24 random bits over [0, range)
+static int randomOffset(quint32& state, int range) {
+    return int((quint64(nextRandom(state))*quint64(range)) >> 24);
+}
+
+// Whole states, the high bits alone would leave a byte in four constant
+static void fillRandom(char* data, int size, quint32& state) {
+    for (int i = 0; i < size; i += 4) {
+        nextRandom(state);
+        memcpy(data + i, &state, qMin(4, size - i));
+    }
+}
+
+static bool writeFile(const QString& path, const QByteArray& data) {
+    QFile file(path);
+
+    return file.open(QIODevice::WriteOnly | QIODevice::Truncate) && file.write(data) == data.size();
+}
+
+// Page cache size, system wide
+static qint64 cachedBytes() {
+    QFile meminfo("/proc/meminfo");
+
+    if (!meminfo.open(QIODevice::ReadOnly | QIODevice::Text))
+        return 0;
+
+    for (QByteArray line = meminfo.readLine(); !line.isEmpty(); line = meminfo.readLine()) {
+        if (line.startsWith("Cached:"))
+            return line.mid(7).trimmed().split(' ').first().toLongLong()*1024;
+    }
+
+    return 0;
+}
+
+// Writes back and drops the cached pages of a file, so that the next run
+// reads it from the disk
+static void dropFromCache(const QString& path) {
+#ifdef Q_OS_LINUX
+    QFile file(path);
+
+    if (file.open(QIODevice::ReadOnly)) {
+        fdatasync(file.handle());
+        posix_fadvise(file.handle(), 0, 0, POSIX_FADV_DONTNEED);
+    }
+#else
+    Q_UNUSED(path);
+#endif
+}
+
+bool Benchmark::run(const QString& name, const QStringList& folders, QString* error) {
+    QTextStream out(stdout);
+
+    if (name == "filter") {
+        filter(out);
+        return true;
+    }
+
+    if (name != "stream" && name != "dedup") {
+        if (error)
+            *error = "Unknown benchmark " + name + " (filter, stream, dedup)";
+        return false;
+    }
+
+    if (folders.size() != 1 || !QDir(folders.first()).exists()) {
+        if (error)
+            *error = "The " + name + " benchmark needs an existing scratch folder";
+        return false;
+    }
+
+    if (name == "dedup")
+        return dedup(QDir(folders.first()), out, error);
+
+    return stream(QDir(folders.first()), out, error);
+}
+
+// Matcher cost per entry for growing rule sets, with only excluding rules
+// (any match wins) and with a "!" rule (the last matching rule wins)
+void Benchmark::filter(QTextStream& out) {
+    const QStringList paths = syntheticPaths(FILTER_PATHS);
+    const int counts[] = { 10, 100, 250, 500, 1000 };
+
+    out << "rules\tns/entry\tns/entry (with !)\texcluded\n";
+
+    for (int count : counts) {
+        int excluded = 0;
+
+        out << count;
+
+        for (int negation = 0; negation < 2; ++negation) {
+            const Filter filter(syntheticRules(count, negation));
+            qint64 best = -1;
+
+            for (int round = 0; round < FILTER_ROUNDS; ++round) {
+                QElapsedTimer timer;
+
+                excluded = 0;
+                timer.start();
+
+                for (int i = 0; i < paths.size(); ++i) {
+                    if (filter.excludes(paths.at(i), i % 8 == 0))
+                        ++excluded;
+                }
+
+                const qint64 elapsed = timer.nsecsElapsed();
+
+                if (best < 0 || elapsed < best)
+                    best = elapsed;
+            }
+
+            out << "\t" << best / paths.size();
+        }
+
+        out << "\t" << excluded << "\n";
+        out.flush();
+    }
+}
+
+// Copy throughput and page cache growth of a large file in the default
+// mode, with --drop-cache and with --direct-io. The source is dropped from
+// the cache before each copy, and the time includes writing the copy back.
+bool Benchmark::stream(const QDir& scratch, QTextStream& out, QString* error) {
+    const QString source = scratch.filePath("fsync-benchmark.src");
+    const QString copy = scratch.filePath("fsync-benchmark.dst");
+    const char* modes[] = { "default", "drop-cache", "direct-io" };
+    QFile file(source);
+    bool ok = true;
+
+    out << "Writing " << STREAM_FILE_SIZE/MEBI << " MiB to " << source << "\n";
+    out.flush();
+
+    if (!file.open(QIODevice::WriteOnly)) {
+        if (error)
+            *error = "Cannot write " + source;
+        return false;
+    }
+
+    QByteArray data(MEBI, Qt::Uninitialized);
+    quint32 state = 1;
+
+    for (qint64 written = 0; ok && written < STREAM_FILE_SIZE; written += data.size()) {
+        fillRandom(data.data(), data.size(), state);
+        ok = file.write(data) == data.size();
+    }
+
+    file.close();
+
+    out << "mode\tMB/s\tcache growth (MiB)\n";
+
+    for (int mode = 0; ok && mode < 3; ++mode) {
+        FileCopier copier;
+        QElapsedTimer timer;
+
+        StreamFile::setCacheMode(mode == 1, mode == 2);
+        dropFromCache(source);
+
+        const qint64 cached = cachedBytes();
+
+        timer.start();
+        ok = copier.copy(source, copy);
+
+        const qint64 growth = cachedBytes() - cached;
+
+        dropFromCache(copy);
+
+        const qint64 elapsed = qMax(timer.elapsed(), qint64(1));
+
+        out << modes[mode] << "\t" << STREAM_FILE_SIZE*1000/elapsed/1000000
+            << "\t" << growth/MEBI << "\n";
+        out.flush();
+
+        QFile::remove(copy);
+    }
+
+    StreamFile::setCacheMode(false, false);
+    QFile::remove(source);
+
+    if (!ok && error)
+        *error = "Cannot copy " + source;
+
+    return ok;
+}
+
+// Deduplicated back-up of a corpus of near-identical files: random base
+// files, and for each one a copy with scattered small edits, a copy with an
+// insertion shifting everything after it and a copy with its second half
+// rewritten
+bool Benchmark::dedup(const QDir& scratch, QTextStream& out, QString* error) {
+    QDir corpus(scratch.filePath("fsync-benchmark-corpus"));
+    QDir storeDir(scratch.filePath("fsync-benchmark-store"));
+    quint32 state = 1;
+    bool ok = true;
+
+    corpus.removeRecursively();
+    storeDir.removeRecursively();
+
+    out << "Writing " << DEDUP_BASE_FILES*4*(DEDUP_FILE_SIZE/MEBI) << " MiB to " << corpus.absolutePath() << "\n";
+    out.flush();
+
+    ok = corpus.mkpath(".");
+
+    for (int i = 0; ok && i < DEDUP_BASE_FILES; ++i) {
+        QByteArray base(DEDUP_FILE_SIZE, Qt::Uninitialized);
+
+        fillRandom(base.data(), base.size(), state);
+
+        QByteArray edited = base, inserted = base, rewritten = base;
+        QByteArray extra(1024, Qt::Uninitialized);
+
+        for (int e = 0; e < DEDUP_EDITS; ++e)
+            fillRandom(edited.data() + randomOffset(state, DEDUP_FILE_SIZE - 16), 16, state);
+
+        fillRandom(extra.data(), extra.size(), state);
+        inserted.insert(randomOffset(state, DEDUP_FILE_SIZE), extra);
+        fillRandom(rewritten.data() + DEDUP_FILE_SIZE/2, DEDUP_FILE_SIZE/2, state);
+
+        ok = writeFile(corpus.filePath(QString("base%1").arg(i)), base) &&
+             writeFile(corpus.filePath(QString("edited%1").arg(i)), edited) &&
+             writeFile(corpus.filePath(QString("inserted%1").arg(i)), inserted) &&
+             writeFile(corpus.filePath(QString("rewritten%1").arg(i)), rewritten);
+    }
+
+    if (!ok) {
+        if (error)
+            *error = "Cannot write the corpus in " + corpus.absolutePath();
+        corpus.removeRecursively();
+        return false;
+    }
+
+    const QStringList names = corpus.entryList(QDir::Files);
+
+    for (auto it = names.begin(); it != names.end(); ++it)
+        dropFromCache(corpus.filePath(*it));
+
+    DedupWorker worker(corpus, storeDir, nullptr);
+    qint64 readBytes = 0, newBytes = 0;
+    int failures = 0;
+    QElapsedTimer timer;
+
+    QObject::connect(&worker, &DedupWorker::stored, [&](qint64 read, qint64 added) {
+        readBytes = read;
+        newBytes = added;
+    });
+    QObject::connect(&worker, &DedupWorker::failed, [&]() {
+        ++failures;
+    });
+
+    timer.start();
+    worker.start();
+    worker.wait();
+
+    const qint64 elapsed = qMax(timer.elapsed(), qint64(1));
+
+    out << "read (MiB)\tstored (MiB)\tratio\tMB/s\tfailures\n"
+        << readBytes/MEBI << "\t" << newBytes/MEBI << "\t"
+        << QString::number(double(readBytes)/qMax(newBytes, qint64(1)), 'f', 2) << "\t"
+        << readBytes*1000/elapsed/1000000 << "\t" << failures << "\n";
+
+    corpus.removeRecursively();
+    storeDir.removeRecursively();
+
+    if (failures && error)
+        *error = QString::number(failures) + " files could not be stored";
+
+    return failures == 0;
+}
+
+// Mix of the rules found in real ignore files: names, extensions,
+// prefixes, anchored globs and a few regular expressions
+QStringList Benchmark::syntheticRules(int count, bool negation) {
+    QStringList rules;
+
+    for (int i = 0; i < count; ++i) {
+        switch (i % 20) {
+            case 0: case 1: case 2: case 3: case 4: case 5: case 6: case 7:
+                rules << QString("name%1").arg(i);
+                break;
+            case 8: case 9: case 10: case 11: case 12:
+                rules << QString("*.ext%1").arg(i);
+                break;
+            case 13: case 14: case 15:
+                rules << QString("tmp%1*").arg(i);
+                break;
+            case 16:
+                rules << QString("build%1/").arg(i);
+                break;
+            case 17: case 18:
+                rules << QString("dir%1/**/*.o%2").arg(i % 50).arg(i);
+                break;
+            default:
+                rules << QString("re:/cache%1/\\d+/(\\w)\\1$").arg(i);
+        }
+    }
+
+    if (negation)
+        rules << "!keep";
+
+    return rules;
+}
+
+QStringList Benchmark::syntheticPaths(int count) {
+    QStringList paths;
+    quint32 state = 1;
+
+    for (int i = 0; i < count; ++i) {
+        const quint32 dir = nextRandom(state) % 100, sub = nextRandom(state) % 1000;
+        const quint32 file = nextRandom(state) % 2000, kind = nextRandom(state) % 4;
+
+        paths << QString("dir%1/sub%2/%3%4.ext%5").arg(dir).arg(sub)
+                 .arg(kind == 0 ? "tmp" : kind == 1 ? "name" : "file").arg(file).arg(file % 1200);
+    }
+
+    return paths;
+}
@@ -0,0 +1,69 @@
+/*Copyright 2017 Pierre Franco
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+#include "chunker.h"
+
+// The hash is shifted left, its top bits depend on the last 64 bytes
+#define CHUNK_MASK_SMALL (~0ULL << (64 - 18))
+#define CHUNK_MASK_LARGE (~0ULL << (64 - 14))
+#define CHUNK_GEAR_SEED 0x6673796e63636463ULL
+
+// Length of the first chunk of data. Data shorter than the maximum size
+// ends a chunk, callers with more data to come must keep it for later.
+int Chunker::cut(const uchar* data, int length) {
+    const quint64* table = gear();
+    const int end = qMin<int>(length, MaxSize);
+    const int normal = qMin<int>(end, AverageSize);
+    quint64 hash = 0;
+    int i = MinSize;
+
+    if (length <= MinSize)
+        return length;
+
+    for (; i < normal; ++i) {
+        hash = (hash << 1) + table[data[i]];
+        if (!(hash & CHUNK_MASK_SMALL))
+            return i + 1;
+    }
+
+    for (; i < end; ++i) {
+        hash = (hash << 1) + table[data[i]];
+        if (!(hash & CHUNK_MASK_LARGE))
+            return i + 1;
+    }
+
+    return end;
+}
+
+// Random values from a fixed seed (splitmix64): the table must never
+// change, or stored chunks would no longer match
+const quint64* Chunker::gear() {
+    static const struct Table {
+        quint64 values[256];
+
+        Table() {
+            quint64 state = CHUNK_GEAR_SEED;
+
+            for (int i = 0; i < 256; ++i) {
+                quint64 z = (state += 0x9e3779b97f4a7c15ULL);
+
+                z = (z ^ (z >> 30))*0xbf58476d1ce4e5b9ULL;
+                z = (z ^ (z >> 27))*0x94d049bb133111ebULL;
+                values[i] = z ^ (z >> 31);
+            }
+        }
+    } table;
+
+    return table.values;
+}
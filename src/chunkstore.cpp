@@ -0,0 +1,328 @@
+/*Copyright 2017 Pierre Franco
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+#include <cstdio>
+#include <QCryptographicHash>
+#include <QFileInfo>
+#include "chunkstore.h"
+#include "varint.h"
+
+#ifdef Q_OS_LINUX
+#include <unistd.h>
+#endif
+
+#define STORE_PACK "chunks.pack"
+#define STORE_INDEX "chunks.index"
+#define STORE_FILES "files"
+#define PACK_MAGIC "FSCP"
+#define INDEX_MAGIC "FSCI"
+#define MANIFEST_MAGIC "FSM1"
+#define MANIFEST_TEMP_SUFFIX ".fsync-tmp"
+#define DIGEST_SIZE 20
+#define STORE_BATCH_COUNT 4096
+#define STORE_BATCH_BYTES (256*1024*1024)
+#define STORE_BATCH_MSECS 1000
+
+ChunkStore::ChunkStore(const QDir& root) :
+    root(root), pack(root.filePath(STORE_PACK)), index(root.filePath(STORE_INDEX)), batchCount(0),
+    packEnd(0), committedEnd(0)
+{}
+
+ChunkStore::~ChunkStore() {
+    if (index.isOpen())
+        commit();
+}
+
+// A store opened for reading only is never created nor repaired
+bool ChunkStore::open(bool writable, QString* error) {
+    const QIODevice::OpenMode mode = writable ? QIODevice::ReadWrite : QIODevice::ReadOnly;
+
+    if ((writable && !root.mkpath(STORE_FILES)) || (!writable && !isStore(root)) ||
+            !pack.open(mode) || !index.open(mode)) {
+        if (error)
+            *error = "The deduplicated store " + root.absolutePath() + " cannot be opened.";
+        return false;
+    }
+
+    if (writable && pack.size() == 0)
+        pack.write(PACK_MAGIC);
+    if (writable && index.size() == 0)
+        index.write(INDEX_MAGIC);
+
+    lastCommit.start();
+
+    return load(writable, error);
+}
+
+// The chunks must be on disk before the index records pointing to them
+bool ChunkStore::commit() {
+    if (batch.isEmpty())
+        return true;
+
+    if (!pack.flush())
+        return false;
+#ifdef Q_OS_LINUX
+    fdatasync(pack.handle());
+#endif
+
+    if (index.write(batch) != batch.size() || !index.flush())
+        return false;
+#ifdef Q_OS_LINUX
+    fdatasync(index.handle());
+#endif
+
+    batch.clear();
+    batchCount = 0;
+    committedEnd = packEnd;
+    lastCommit.restart();
+
+    return true;
+}
+
+bool ChunkStore::isCommitDue() const {
+    return !batch.isEmpty() && (batchCount >= STORE_BATCH_COUNT ||
+                                packEnd - committedEnd >= STORE_BATCH_BYTES ||
+                                lastCommit.elapsed() >= STORE_BATCH_MSECS);
+}
+
+bool ChunkStore::contains(const QByteArray& digest) const {
+    return locations.contains(digest);
+}
+
+bool ChunkStore::add(const QByteArray& digest, const char* data, int length) {
+    const Location location = { packEnd, quint64(length) };
+
+    if (pack.pos() != qint64(packEnd) && !pack.seek(packEnd))
+        return false;
+
+    if (pack.write(data, length) != length)
+        return false;
+
+    packEnd += length;
+    locations.insert(digest, location);
+
+    batch.append(digest);
+    appendVarint(batch, location.offset);
+    appendVarint(batch, location.length);
+    ++batchCount;
+
+    return true;
+}
+
+// Chunks are checked against their digest, a damaged pack is never
+// restored silently
+bool ChunkStore::read(const QByteArray& digest, QByteArray& data) {
+    auto it = locations.constFind(digest);
+
+    if (it == locations.constEnd() || !pack.seek(qint64(it->offset)))
+        return false;
+
+    data = pack.read(qint64(it->length));
+
+    return quint64(data.size()) == it->length &&
+            QCryptographicHash::hash(data, QCryptographicHash::Sha1) == digest;
+}
+
+QDir ChunkStore::manifests() const {
+    return QDir(root.filePath(STORE_FILES));
+}
+
+bool ChunkStore::restore(const QDir& target, QString* error) {
+    return restoreDir(manifests(), target, error);
+}
+
+bool ChunkStore::isStore(const QDir& dir) {
+    return QFile::exists(dir.filePath(STORE_PACK)) && QFile::exists(dir.filePath(STORE_INDEX));
+}
+
+bool ChunkStore::readManifest(const QString& path, Manifest& manifest) {
+    QFile file(path);
+
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+
+    const QByteArray data = file.readAll();
+    const uchar* pos = reinterpret_cast<const uchar*>(data.constData()) + qstrlen(MANIFEST_MAGIC);
+    const uchar* end = reinterpret_cast<const uchar*>(data.constData()) + data.size();
+    quint64 size, modified, permissions, count;
+
+    if (!data.startsWith(MANIFEST_MAGIC) || !readVarint(pos, end, size) || !readVarint(pos, end, modified) ||
+            !readVarint(pos, end, permissions) || !readVarint(pos, end, count) ||
+            count > quint64(end - pos)/DIGEST_SIZE)
+        return false;
+
+    manifest.size = qint64(size);
+    manifest.modified = qint64(modified);
+    manifest.permissions = int(permissions);
+    manifest.chunks.clear();
+    manifest.chunks.reserve(int(count));
+
+    for (quint64 i = 0; i < count; ++i, pos += DIGEST_SIZE)
+        manifest.chunks.append(QByteArray(reinterpret_cast<const char*>(pos), DIGEST_SIZE));
+
+    return true;
+}
+
+// Manifests are written next to their final name without being synced,
+// a batch of them is synced at once then published
+bool ChunkStore::writeManifest(const QString& path, const Manifest& manifest) {
+    QFile file(path + MANIFEST_TEMP_SUFFIX);
+    QByteArray data(MANIFEST_MAGIC);
+
+    appendVarint(data, quint64(manifest.size));
+    appendVarint(data, quint64(manifest.modified));
+    appendVarint(data, quint64(manifest.permissions));
+    appendVarint(data, quint64(manifest.chunks.size()));
+
+    for (auto it = manifest.chunks.begin(); it != manifest.chunks.end(); ++it)
+        data.append(*it);
+
+    return file.open(QIODevice::WriteOnly | QIODevice::Truncate) && file.write(data) == data.size() &&
+            file.flush();
+}
+
+// A manifest lost by a crash before its rename is only a file stored
+// again by the next run, a manifest is never seen half written
+bool ChunkStore::publishManifest(const QString& path) {
+#ifdef Q_OS_UNIX
+    return std::rename(QFile::encodeName(path + MANIFEST_TEMP_SUFFIX).constData(),
+                       QFile::encodeName(path).constData()) == 0;
+#else
+    QFile::remove(path);
+    return QFile::rename(path + MANIFEST_TEMP_SUFFIX, path);
+#endif
+}
+
+// Name a manifest will have once published, the name itself otherwise
+QString ChunkStore::publishedName(const QString& name) {
+    if (!name.endsWith(MANIFEST_TEMP_SUFFIX))
+        return name;
+
+    return name.left(name.size() - int(sizeof(MANIFEST_TEMP_SUFFIX) - 1));
+}
+
+// One sync of the store filesystem for a batch of written manifests
+bool ChunkStore::syncManifests() {
+#ifdef Q_OS_LINUX
+    return syncfs(index.handle()) == 0;
+#else
+    return true;
+#endif
+}
+
+// Index records pointing past the end of the pack, or truncated by a
+// crash, are dropped
+bool ChunkStore::load(bool writable, QString* error) {
+    pack.seek(0);
+    index.seek(0);
+
+    const QByteArray data = index.readAll();
+    const uchar* begin = reinterpret_cast<const uchar*>(data.constData());
+    const uchar* end = begin + data.size();
+    const uchar* pos = begin + qstrlen(INDEX_MAGIC);
+    qint64 valid = pos - begin;
+
+    packEnd = committedEnd = quint64(pack.size());
+
+    if (!data.startsWith(INDEX_MAGIC) || pack.read(qstrlen(PACK_MAGIC)) != PACK_MAGIC) {
+        if (error)
+            *error = root.absolutePath() + " is not a deduplicated store.";
+        return false;
+    }
+
+    while (end - pos >= DIGEST_SIZE) {
+        const QByteArray digest(reinterpret_cast<const char*>(pos), DIGEST_SIZE);
+        Location location;
+
+        pos += DIGEST_SIZE;
+
+        if (!readVarint(pos, end, location.offset) || !readVarint(pos, end, location.length) ||
+                location.offset > packEnd || location.length > packEnd - location.offset)
+            break;
+
+        locations.insert(digest, location);
+        valid = pos - begin;
+    }
+
+    if (writable && valid != data.size())
+        index.resize(valid);
+
+    index.seek(index.size());
+    pack.seek(qint64(packEnd));
+
+    return true;
+}
+
+bool ChunkStore::restoreDir(const QDir& src, const QDir& dst, QString* error) {
+    const QFileInfoList entries = src.entryInfoList(QDir::Dirs | QDir::Files |
+                                                    QDir::NoDotAndDotDot | QDir::NoSymLinks);
+
+    if (!dst.mkpath(".")) {
+        if (error)
+            *error = "The folder " + dst.absolutePath() + " cannot be created.";
+        return false;
+    }
+
+    for (auto it = entries.begin(); it != entries.end(); ++it) {
+        // Left by an interrupted back-up
+        if (it->fileName().endsWith(MANIFEST_TEMP_SUFFIX))
+            continue;
+
+        if (it->isDir()) {
+            if (!restoreDir(QDir(it->absoluteFilePath()), QDir(dst.filePath(it->fileName())), error))
+                return false;
+            continue;
+        }
+
+        Manifest manifest;
+        QFile out(dst.filePath(it->fileName()));
+        QByteArray chunk;
+
+        if (!readManifest(it->absoluteFilePath(), manifest)) {
+            if (error)
+                *error = "The manifest " + it->absoluteFilePath() + " is invalid.";
+            return false;
+        }
+
+        if (!out.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+            if (error)
+                *error = "The file " + out.fileName() + " cannot be written.";
+            return false;
+        }
+
+        for (auto cit = manifest.chunks.begin(); cit != manifest.chunks.end(); ++cit) {
+            if (!read(*cit, chunk)) {
+                if (error)
+                    *error = "A chunk of " + out.fileName() + " is missing or damaged.";
+                return false;
+            }
+
+            if (out.write(chunk) != chunk.size()) {
+                if (error)
+                    *error = "The file " + out.fileName() + " cannot be written.";
+                return false;
+            }
+        }
+
+        out.setPermissions(QFile::Permissions(manifest.permissions));
+
+        if (!out.flush() || out.size() != manifest.size) {
+            if (error)
+                *error = "The file " + out.fileName() + " was not restored entirely.";
+            return false;
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,329 @@
+/*Copyright 2017 Pierre Franco
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QRunnable>
+#include <QSet>
+#include "chunker.h"
+#include "dedupworker.h"
+#include "ratelimiter.h"
+#include "streamfile.h"
+
+#define DEDUP_SEGMENT_SIZE (16*1024*1024)
+#define DEDUP_QUEUED_SEGMENTS 2
+#define DEDUP_BATCH_MANIFESTS 1024
+#define DEDUP_BATCH_MSECS 1000
+
+// Hashes a range of the chunks of a segment, each task writes its own
+// digests and signals the writer once done
+class HashTask : public QRunnable {
+    public:
+        HashTask(const char* data, const int* ends, QByteArray* digests, int first, int last,
+                 QSemaphore* done) :
+            data(data), ends(ends), digests(digests), first(first), last(last), done(done)
+        {}
+
+        void run() {
+            for (int i = first; i < last; ++i) {
+                const int start = i ? ends[i - 1] : 0;
+
+                digests[i] = QCryptographicHash::hash(QByteArray::fromRawData(data + start, ends[i] - start),
+                                                      QCryptographicHash::Sha1);
+            }
+
+            done->release();
+        }
+
+    private:
+        const char* data;
+        const int* ends;
+        QByteArray* digests;
+        int first, last;
+        QSemaphore* done;
+};
+
+// Segments are written in order, by the only thread of the writer pool
+class WriteTask : public QRunnable {
+    public:
+        WriteTask(DedupWorker* worker, DedupWorker::Segment* segment) :
+            worker(worker), segment(segment)
+        {}
+
+        void run() {
+            worker->write(segment);
+        }
+
+    private:
+        DedupWorker* worker;
+        DedupWorker::Segment* segment;
+};
+
+DedupWorker::DedupWorker(const QDir& master, const QDir& destination, const Filter* filter) :
+    master(master), store(destination), filter(filter), queued(DEDUP_QUEUED_SEGMENTS),
+    readBytes(0), newBytes(0), cancel(false)
+{
+    writer.setMaxThreadCount(1);
+}
+
+void DedupWorker::cancelWork() {
+    cancel = true;
+}
+
+void DedupWorker::run() {
+    QString error;
+
+    RateLimiter::instance().applyPriority();
+
+    if (!store.open(true, &error)) {
+        emit failed(error);
+        return;
+    }
+
+    lastPublish.start();
+    storeDir(master, store.manifests());
+    writer.waitForDone();
+    publish(store.commit());
+
+    emit stored(readBytes, newBytes);
+}
+
+// Manifests of excluded files are kept, like excluded files of a mirror
+void DedupWorker::storeDir(const QDir& dir, const QDir& manifests) {
+    const QString path = master.relativeFilePath(dir.absolutePath());
+    const QString prefix = path.isEmpty() || path == "." ? QString() : path + "/";
+    QSet<QString> names;
+
+    RateLimiter::instance().acquireOps(2);
+    manifests.mkpath(".");
+
+    const QFileInfoList entries = dir.entryInfoList(QDir::Dirs | QDir::Files |
+                                                    QDir::NoDotAndDotDot | QDir::NoSymLinks);
+
+    for (auto it = entries.begin(); it != entries.end(); ++it) {
+        if (cancel)
+            return;
+
+        const QString manifest = manifests.filePath(it->fileName());
+
+        names.insert(it->fileName());
+
+        if (filter && filter->excludes(prefix + it->fileName(), it->isDir()))
+            continue;
+
+        // A file replaced by a folder, or the opposite
+        if (it->isDir() && QFileInfo(manifest).isFile())
+            QFile::remove(manifest);
+        else if (!it->isDir() && QFileInfo(manifest).isDir())
+            QDir(manifest).removeRecursively();
+
+        if (it->isDir())
+            storeDir(QDir(it->absoluteFilePath()), QDir(manifest));
+        else
+            storeFile(*it, manifest);
+    }
+
+    if (cancel)
+        return;
+
+    RateLimiter::instance().acquireOps();
+    const QFileInfoList manifestList = manifests.entryInfoList(QDir::Dirs | QDir::Files |
+                                                               QDir::NoDotAndDotDot | QDir::NoSymLinks);
+
+    // A manifest waiting on the writer thread is still under its temporary
+    // name, only those of files gone from the source are removed
+    for (auto it = manifestList.begin(); it != manifestList.end(); ++it) {
+        if (names.contains(ChunkStore::publishedName(it->fileName())))
+            continue;
+        if (it->isDir())
+            QDir(it->absoluteFilePath()).removeRecursively();
+        else
+            QFile::remove(it->absoluteFilePath());
+    }
+}
+
+// Failures are reported by the writer, once the file is written
+void DedupWorker::storeFile(const QFileInfo& info, const QString& path) {
+    RateLimiter& limiter = RateLimiter::instance();
+    const qint64 modified = info.lastModified().toMSecsSinceEpoch();
+    ChunkStore::Manifest previous;
+
+    if (ChunkStore::readManifest(path, previous) && previous.size == info.size() &&
+            previous.modified == modified)
+        return;
+
+    emit itemChanged("Storing file " + info.absoluteFilePath());
+
+    StreamFile file(info.absoluteFilePath());
+    char* buffer = StreamFile::acquireBuffer();
+    File* stored = new File;
+    QByteArray carry;
+    bool eof = false;
+
+    stored->source = info.absoluteFilePath();
+    stored->path = path;
+    stored->manifest.size = info.size();
+    stored->manifest.modified = modified;
+    stored->manifest.permissions = int(info.permissions());
+    stored->valid = stored->failed = false;
+
+    limiter.acquireOps();
+    bool ok = file.open(QIODevice::ReadOnly);
+
+    // A failed or canceled read still ends the file for the writer
+    while (!eof) {
+        Segment* segment = new Segment;
+        int pos = 0;
+
+        segment->file = stored;
+        segment->data = carry;
+
+        while (ok && !cancel && segment->data.size() < DEDUP_SEGMENT_SIZE) {
+            const qint64 length = file.read(buffer, StreamFile::BufferSize);
+
+            if (length <= 0) {
+                ok = length == 0;
+                eof = true;
+                break;
+            }
+
+            limiter.acquireBytes(length);
+            segment->data.append(buffer, int(length));
+        }
+
+        eof = eof || !ok || cancel;
+
+        // Before the end of the file, a cut is only final with a whole
+        // maximum chunk ahead of it, the rest goes to the next segment
+        while (ok && !cancel && pos < segment->data.size() &&
+               (eof || segment->data.size() - pos >= Chunker::MaxSize)) {
+            pos += Chunker::cut(reinterpret_cast<const uchar*>(segment->data.constData()) + pos,
+                                segment->data.size() - pos);
+            segment->ends.append(pos);
+        }
+
+        carry = segment->data.mid(pos);
+        segment->last = eof;
+
+        // A file changed while being read is stored again by the next run
+        if (eof) {
+            const QFileInfo after(info.absoluteFilePath());
+
+            stored->valid = ok && !cancel && after.size() == stored->manifest.size &&
+                            after.lastModified().toMSecsSinceEpoch() == modified;
+        }
+
+        hash(segment);
+        queued.acquire();
+        writer.start(new WriteTask(this, segment));
+    }
+
+    StreamFile::releaseBuffer(buffer);
+}
+
+// The chunks are split in one range per thread
+void DedupWorker::hash(Segment* segment) {
+    const int count = segment->ends.size();
+
+    segment->tasks = qMin(count, pool.maxThreadCount());
+    segment->digests.resize(count);
+    QByteArray* digests = segment->digests.data();
+
+    for (int i = 0; i < segment->tasks; ++i)
+        pool.start(new HashTask(segment->data.constData(), segment->ends.constData(), digests,
+                                count*i/segment->tasks, count*(i + 1)/segment->tasks, &segment->hashed));
+}
+
+// Runs on the writer thread: the chunks of the segment are appended once
+// hashed, and the store is committed by batches
+void DedupWorker::write(Segment* segment) {
+    File* stored = segment->file;
+
+    segment->hashed.acquire(segment->tasks);
+
+    if (!cancel && !stored->failed)
+        stored->failed = !storeChunks(*segment, stored->manifest);
+
+    if (segment->last) {
+        if (stored->valid && !stored->failed && !cancel) {
+            pending.append(stored);
+        } else {
+            if (!cancel)
+                emit failed(stored->source);
+            delete stored;
+        }
+    }
+
+    delete segment;
+    queued.release();
+
+    // Files made of known chunks only still wait for a batch, so that
+    // manifests are not synced one by one
+    if (store.isCommitDue() || pending.size() >= DEDUP_BATCH_MANIFESTS ||
+            (!pending.isEmpty() && lastPublish.elapsed() >= DEDUP_BATCH_MSECS))
+        publish(store.commit());
+}
+
+bool DedupWorker::storeChunks(const Segment& segment, ChunkStore::Manifest& manifest) {
+    for (int i = 0; i < segment.ends.size(); ++i) {
+        const int start = i ? segment.ends.at(i - 1) : 0;
+        const int length = segment.ends.at(i) - start;
+        const QByteArray& digest = segment.digests.at(i);
+
+        readBytes += length;
+        manifest.chunks.append(digest);
+
+        if (store.contains(digest))
+            continue;
+
+        RateLimiter::instance().acquireBytes(length);
+
+        if (!store.add(digest, segment.data.constData() + start, length))
+            return false;
+
+        newBytes += length;
+    }
+
+    return true;
+}
+
+// Manifests waiting for their chunks are written once these are committed,
+// then synced together and published
+void DedupWorker::publish(bool committed) {
+    QList<File*> written;
+
+    lastPublish.restart();
+
+    if (pending.isEmpty())
+        return;
+
+    for (auto it = pending.begin(); it != pending.end(); ++it) {
+        if (committed && ChunkStore::writeManifest((*it)->path, (*it)->manifest)) {
+            written.append(*it);
+        } else {
+            emit failed((*it)->source);
+            delete *it;
+        }
+    }
+
+    pending.clear();
+
+    const bool synced = !written.isEmpty() && store.syncManifests();
+
+    for (auto it = written.begin(); it != written.end(); ++it) {
+        if (!synced || !ChunkStore::publishManifest((*it)->path))
+            emit failed((*it)->source);
+        delete *it;
+    }
+}
@@ -0,0 +1,182 @@
+/*Copyright 2017 Pierre Franco
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QFile>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include "digeststore.h"
+#include "varint.h"
+
+#define DIGEST_MAGIC "FSD2"
+#define DIGEST_BATCH_BYTES (256*1024)
+#define DIGEST_COMPACT_MIN 4096
+
+DigestStore::DigestStore(const QDir& master) :
+    path(location(master)), loaded(false)
+{}
+
+DigestStore::~DigestStore() {
+    commit();
+}
+
+// Loading is deferred to the worker thread using the store
+void DigestStore::load() {
+    if (loaded)
+        return;
+
+    loaded = true;
+
+    QFile file(path);
+
+    if (!file.open(QIODevice::ReadOnly))
+        return;
+
+    const QByteArray data = file.readAll();
+    const uchar* end = reinterpret_cast<const uchar*>(data.constData()) + data.size();
+    const uchar* pos = reinterpret_cast<const uchar*>(data.constData()) + qstrlen(DIGEST_MAGIC);
+    int records = 0;
+
+    file.close();
+
+    quint64 compacted;
+
+    // The header holds the entry count of the last compaction
+    if (!data.startsWith(DIGEST_MAGIC) || !readVarint(pos, end, compacted)) {
+        QFile::remove(path);
+        return;
+    }
+
+    // A truncated record at the end is ignored, compacting drops it
+    while (pos < end) {
+        quint64 length, size, modified, digestLength;
+
+        if (!readVarint(pos, end, length) || length > quint64(end - pos))
+            break;
+
+        const QString name = QString::fromUtf8(reinterpret_cast<const char*>(pos), int(length));
+        pos += length;
+
+        if (!readVarint(pos, end, size) || !readVarint(pos, end, modified) ||
+                !readVarint(pos, end, digestLength) || digestLength > quint64(end - pos))
+            break;
+
+        const Entry entry = { qint64(size), qint64(modified),
+                              QByteArray(reinterpret_cast<const char*>(pos), int(digestLength)) };
+        pos += digestLength;
+
+        entries.insert(name, entry);
+        ++records;
+    }
+
+    // Superseded records and files no longer there (removed, or recorded
+    // in a snapshot since discarded) are dropped when either doubled
+    if (pos != end || (records > DIGEST_COMPACT_MIN &&
+                       (records > 2*entries.size() || quint64(entries.size()) > 2*compacted)))
+        compact();
+}
+
+void DigestStore::commit() {
+    if (batch.isEmpty())
+        return;
+
+    QDir().mkpath(QFileInfo(path).absolutePath());
+
+    QFile file(path);
+
+    if (file.open(QIODevice::WriteOnly | QIODevice::Append)) {
+        if (file.size() == 0) {
+            QByteArray header(DIGEST_MAGIC);
+
+            appendVarint(header, 0);
+            file.write(header);
+        }
+        file.write(batch);
+    }
+
+    batch.clear();
+}
+
+QByteArray DigestStore::lookup(const QFileInfo& info) const {
+    auto it = entries.constFind(info.absoluteFilePath());
+
+    if (it == entries.constEnd() || it->size != info.size() ||
+            it->modified != info.lastModified().toMSecsSinceEpoch())
+        return QByteArray();
+
+    return it->digest;
+}
+
+void DigestStore::record(const QFileInfo& info, const QByteArray& digest) {
+    record(info.absoluteFilePath(), info, digest);
+}
+
+// Records a file under the path it will have, such as its place in a
+// snapshot once completed
+void DigestStore::record(const QString& name, const QFileInfo& info, const QByteArray& digest) {
+    const Entry entry = { info.size(), info.lastModified().toMSecsSinceEpoch(), digest };
+
+    entries.insert(name, entry);
+    append(batch, name, entry);
+
+    if (batch.size() >= DIGEST_BATCH_BYTES)
+        commit();
+}
+
+QString DigestStore::location(const QDir& master) {
+    const QByteArray id = QCryptographicHash::hash(master.absolutePath().toUtf8(),
+                                                   QCryptographicHash::Sha1).toHex();
+
+    return QStandardPaths::writableLocation(QStandardPaths::AppDataLocation) +
+            "/digests/" + QString::fromLatin1(id) + ".digests";
+}
+
+// Only entries still matching their file are kept
+void DigestStore::compact() {
+    QSaveFile file(path);
+    QByteArray data(DIGEST_MAGIC), records;
+
+    for (auto it = entries.begin(); it != entries.end();) {
+        const QFileInfo info(it.key());
+
+        if (!info.exists() || info.size() != it->size ||
+                info.lastModified().toMSecsSinceEpoch() != it->modified) {
+            it = entries.erase(it);
+            continue;
+        }
+
+        append(records, it.key(), it.value());
+        ++it;
+    }
+
+    appendVarint(data, entries.size());
+    data.append(records);
+
+    if (file.open(QIODevice::WriteOnly)) {
+        file.write(data);
+        file.commit();
+    }
+}
+
+void DigestStore::append(QByteArray& data, const QString& name, const Entry& entry) {
+    const QByteArray utf8 = name.toUtf8();
+
+    appendVarint(data, utf8.size());
+    data.append(utf8);
+    appendVarint(data, quint64(entry.size));
+    appendVarint(data, quint64(entry.modified));
+    appendVarint(data, entry.digest.size());
+    data.append(entry.digest);
+}
@@ -0,0 +1,127 @@
+/*Copyright 2017 Pierre Franco
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+#include <QCryptographicHash>
+#include <QList>
+#include "filecopier.h"
+#include "ratelimiter.h"
+#include "streamfile.h"
+
+#define COPY_HASH QCryptographicHash::Sha1
+
+QAtomicInt FileCopier::verify;
+
+FileCopier::FileCopier() : buffer(StreamFile::acquireBuffer())
+{}
+
+FileCopier::~FileCopier() {
+    StreamFile::releaseBuffer(buffer);
+}
+
+bool FileCopier::copy(const QString& src, const QString& dst) {
+    return copy(src, QStringList(dst)).first();
+}
+
+// A destination failing is dropped, the others are still written
+QVector<bool> FileCopier::copy(const QString& src, const QStringList& dsts) {
+    RateLimiter& limiter = RateLimiter::instance();
+    QVector<bool> copied(dsts.size(), false);
+    QCryptographicHash hasher(COPY_HASH);
+    QList<StreamFile*> outs;
+    StreamFile in(src);
+    int open = 0;
+
+    sourceDigest.clear();
+    limiter.acquireOps(1 + dsts.size());
+
+    if (!in.open(QIODevice::ReadOnly))
+        return copied;
+
+    for (int i = 0; i < dsts.size(); ++i) {
+        outs.append(new StreamFile(dsts.at(i)));
+        copied[i] = outs.last()->open(QIODevice::WriteOnly | QIODevice::Truncate);
+        if (copied[i])
+            ++open;
+    }
+
+    for (qint64 length; open > 0 && (length = in.read(buffer, StreamFile::BufferSize)) != 0;) {
+        if (length < 0) {
+            copied.fill(false);
+            break;
+        }
+
+        // Read and written bytes both count
+        limiter.acquireBytes((1 + open)*length);
+        hasher.addData(buffer, int(length));
+
+        for (int i = 0; i < outs.size(); ++i) {
+            if (copied[i] && !outs.at(i)->write(buffer, length)) {
+                copied[i] = false;
+                --open;
+            }
+        }
+    }
+
+    for (int i = 0; i < outs.size(); ++i) {
+        if (copied[i]) {
+            outs.at(i)->file().setPermissions(in.file().permissions());
+            copied[i] = outs.at(i)->finish();
+        }
+    }
+
+    qDeleteAll(outs);
+
+    if (copied.contains(true))
+        sourceDigest = hasher.result();
+
+    // The source is never read twice, each destination is read back once
+    for (int i = 0; verify.loadAcquire() && i < dsts.size(); ++i) {
+        if (copied[i])
+            copied[i] = hash(dsts.at(i), buffer, true) == sourceDigest;
+    }
+
+    return copied;
+}
+
+// Digest of the source of the last copy, empty when it failed
+const QByteArray& FileCopier::digest() const {
+    return sourceDigest;
+}
+
+// Takes effect on the next copied file
+void FileCopier::setVerify(bool enabled) {
+    verify.storeRelease(enabled ? 1 : 0);
+}
+
+// Hashes a file through an aligned buffer, empty on failure
+QByteArray FileCopier::hash(const QString& path, char* data, bool uncached) {
+    RateLimiter& limiter = RateLimiter::instance();
+    QCryptographicHash hasher(COPY_HASH);
+    StreamFile file(path);
+
+    limiter.acquireOps();
+
+    if (!file.open(QIODevice::ReadOnly, uncached ? StreamFile::Uncached : StreamFile::Sequential))
+        return QByteArray();
+
+    for (qint64 length; (length = file.read(data, StreamFile::BufferSize)) != 0;) {
+        if (length < 0)
+            return QByteArray();
+
+        limiter.acquireBytes(length);
+        hasher.addData(data, int(length));
+    }
+
+    return hasher.result();
+}
@@ -0,0 +1,263 @@
+/*Copyright 2017 Pierre Franco
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+#include "filter.h"
+
+#define REGEX_PREFIX "re:"
+
+static bool hasWildcard(const QString& glob) {
+    for (auto it = glob.begin(); it != glob.end(); ++it) {
+        if (*it == '*' || *it == '?' || *it == '[' || *it == '\\')
+            return true;
+    }
+
+    return false;
+}
+
+Filter::Filter() : hasNegation(false), empty(true)
+{}
+
+Filter::Filter(const QStringList& rules) :
+    rules(rules), negated(rules.size(), false), hasNegation(false), empty(true)
+{
+    for (int i = 0; i < rules.size(); ++i)
+        compile(i, rules.at(i).trimmed());
+
+    build();
+}
+
+bool Filter::isEmpty() const {
+    return empty;
+}
+
+const QStringList& Filter::getRules() const {
+    return rules;
+}
+
+const QStringList& Filter::getErrors() const {
+    return errors;
+}
+
+bool Filter::excludes(const QString& path, bool isDir) const {
+    if (empty)
+        return false;
+
+    const QStringRef name = path.midRef(path.lastIndexOf('/') + 1);
+    int best = lookup(tables[0], name);
+
+    if (isDir)
+        best = qMax(best, lookup(tables[1], name));
+
+    // Without "!" rules any match excludes, so a single pass of the
+    // combined glob expression is enough, then each regular expression
+    if (!hasNegation) {
+        if (best >= 0)
+            return true;
+        if (!automaton[isDir].pattern().isEmpty() && automaton[isDir].match(path).hasMatch())
+            return true;
+
+        for (auto it = expressions.begin(); it != expressions.end(); ++it) {
+            if (it->match(path).hasMatch())
+                return true;
+        }
+
+        return false;
+    }
+
+    for (auto it = patterns.crbegin(); it != patterns.crend() && it->rule > best; ++it) {
+        if ((isDir || !it->dirOnly) && it->regex.match(path).hasMatch()) {
+            best = it->rule;
+            break;
+        }
+    }
+
+    return best >= 0 && !negated.at(best);
+}
+
+void Filter::compile(int index, QString rule) {
+    bool dirOnly = false, anchored = false;
+
+    if (rule.isEmpty() || rule.startsWith('#'))
+        return;
+
+    if (rule.startsWith('!')) {
+        negated[index] = true;
+        hasNegation = true;
+        rule.remove(0, 1);
+    }
+
+    empty = false;
+
+    if (rule.startsWith(REGEX_PREFIX)) {
+        QRegularExpression regex(rule.mid(qstrlen(REGEX_PREFIX)));
+
+        if (!regex.isValid()) {
+            errors.append(rules.at(index) + ": " + regex.errorString());
+            return;
+        }
+
+        // Kept apart from the combined expression, where its groups would
+        // be renumbered and its backreferences broken
+        patterns.append({ index, false, false, regex });
+        expressions.append(regex);
+        return;
+    }
+
+    if (rule.endsWith('/')) {
+        dirOnly = true;
+        rule.chop(1);
+    }
+
+    if (rule.startsWith('/')) {
+        anchored = true;
+        rule.remove(0, 1);
+    } else if (rule.startsWith("**/")) {
+        rule.remove(0, 3);
+        anchored = rule.contains('/');
+    } else {
+        anchored = rule.contains('/');
+    }
+
+    if (rule.isEmpty())
+        return;
+
+    Table& table = tables[dirOnly ? 1 : 0];
+
+    if (!anchored) {
+        if (!hasWildcard(rule)) {
+            insert(table.names, nullptr, rule, index);
+            return;
+        }
+        if (rule.startsWith('*') && !hasWildcard(rule.mid(1))) {
+            insert(table.suffixes, &table.suffixLengths, rule.mid(1), index);
+            return;
+        }
+        if (rule.endsWith('*') && !hasWildcard(rule.left(rule.size() - 1))) {
+            insert(table.prefixes, &table.prefixLengths, rule.left(rule.size() - 1), index);
+            return;
+        }
+    }
+
+    QRegularExpression regex("^" + QString(anchored ? "" : "(?:.*/)?") +
+                             "(?:" + globToRegex(rule) + ")$");
+
+    if (!regex.isValid()) {
+        errors.append(rules.at(index) + ": " + regex.errorString());
+        return;
+    }
+
+    patterns.append({ index, dirOnly, true, regex });
+}
+
+// Only glob rules are merged, their expressions have no groups
+void Filter::build() {
+    for (int t = 0; t < 2; ++t) {
+        QStringList alternatives;
+
+        for (auto it = patterns.begin(); it != patterns.end(); ++it) {
+            if (it->glob && (t == 1 || !it->dirOnly))
+                alternatives.append(it->regex.pattern());
+        }
+
+        if (alternatives.isEmpty())
+            continue;
+
+        automaton[t].setPattern("(?:" + alternatives.join(")|(?:") + ")");
+        automaton[t].optimize();
+    }
+}
+
+int Filter::lookup(const Table& table, const QStringRef& name) const {
+    int best = find(table.names, name);
+
+    for (auto it = table.prefixLengths.begin(); it != table.prefixLengths.end(); ++it) {
+        if (*it <= name.size())
+            best = qMax(best, find(table.prefixes, name.left(*it)));
+    }
+
+    for (auto it = table.suffixLengths.begin(); it != table.suffixLengths.end(); ++it) {
+        if (*it <= name.size())
+            best = qMax(best, find(table.suffixes, name.right(*it)));
+    }
+
+    return best;
+}
+
+int Filter::find(const Literals& literals, const QStringRef& key) {
+    const uint hash = qHash(key);
+    int best = -1;
+
+    for (auto it = literals.constFind(hash); it != literals.constEnd() && it.key() == hash; ++it) {
+        if (it->text == key)
+            best = qMax(best, it->rule);
+    }
+
+    return best;
+}
+
+void Filter::insert(Literals& literals, QList<int>* lengths, const QString& key, int index) {
+    // Rules are compiled in order, so a later rule replaces an earlier one
+    const uint hash = qHash(key);
+
+    for (auto it = literals.find(hash); it != literals.end() && it.key() == hash; ++it) {
+        if (it->text == key) {
+            it->rule = index;
+            return;
+        }
+    }
+
+    literals.insert(hash, { key, index });
+
+    if (lengths && !lengths->contains(key.size()))
+        lengths->append(key.size());
+}
+
+QString Filter::globToRegex(const QString& glob) {
+    QString regex;
+
+    for (int i = 0; i < glob.size(); ++i) {
+        const QChar c = glob.at(i);
+
+        if (c == '*' && i + 1 < glob.size() && glob.at(i + 1) == '*') {
+            const bool atStart = i == 0 || glob.at(i - 1) == '/';
+
+            ++i;
+            if (atStart && i + 1 < glob.size() && glob.at(i + 1) == '/') {
+                regex += "(?:.*/)?";
+                ++i;
+            } else {
+                regex += ".*";
+            }
+        } else if (c == '*') {
+            regex += "[^/]*";
+        } else if (c == '?') {
+            regex += "[^/]";
+        } else if (c == '[' && glob.indexOf(']', i + 2) > 0) {
+            const int close = glob.indexOf(']', i + 2);
+            QString set = glob.mid(i + 1, close - i - 1);
+
+            if (set.startsWith('!'))
+                set[0] = '^';
+
+            regex += "[" + set + "]";
+            i = close;
+        } else if (c == '\\' && i + 1 < glob.size()) {
+            regex += QRegularExpression::escape(glob.at(++i));
+        } else {
+            regex += QRegularExpression::escape(c);
+        }
+    }
+
+    return regex;
+}
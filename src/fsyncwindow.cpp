@@ -15,14 +15,26 @@
 #include <QFileDialog>
 #include <QHeaderView>
 #include <QMessageBox>
+#include <QTime>
 
 #include "fsyncwindow.h"
 #include "ui_fsyncwindow.h"
 #include "analyzeworker.h"
 #include "applyworker.h"
+#include "dedupworker.h"
+#include "filecopier.h"
+#include "journal.h"
+#include "plan.h"
+#include "ratelimiter.h"
+#include "snapshot.h"
+#include "streamfile.h"
+#include "watchworker.h"
+
+#define TABLE_MAX_CHANGES 100000
+#define FAILURES_SHOWN 10
 
 FsyncWindow::FsyncWindow(QWidget *parent) :
-    QWidget(parent), timer(nullptr), ui(new Ui::FsyncWindow), root(nullptr), time(0)
+    QWidget(parent), timer(nullptr), ui(new Ui::FsyncWindow), snapshots(false), dedupRead(0), dedupNew(0), time(0)
 {
     timer = new QTimer(this);
 
@@ -37,15 +49,59 @@ FsyncWindow::FsyncWindow(QWidget *parent) :
 
     QObject::connect(ui->analyzeButton, SIGNAL(pressed()), SLOT(analyze()));
     QObject::connect(ui->saveButton, SIGNAL(pressed()), SLOT(save()));
+    QObject::connect(ui->savePlanButton, SIGNAL(pressed()), SLOT(savePlan()));
+    QObject::connect(ui->loadPlanButton, SIGNAL(pressed()), SLOT(loadPlan()));
+    QObject::connect(ui->watchButton, SIGNAL(pressed()), SLOT(watch()));
+    QObject::connect(ui->dedupButton, SIGNAL(pressed()), SLOT(dedup()));
+
+    QObject::connect(ui->bandwidthSpin, SIGNAL(valueChanged(int)), SLOT(updateThrottle()));
+    QObject::connect(ui->opsSpin, SIGNAL(valueChanged(int)), SLOT(updateThrottle()));
+    QObject::connect(ui->idleCheck, SIGNAL(toggled(bool)), SLOT(updateThrottle()));
+    QObject::connect(ui->dropCacheCheck, SIGNAL(toggled(bool)), SLOT(updateCacheMode()));
+    QObject::connect(ui->directCheck, SIGNAL(toggled(bool)), SLOT(updateCacheMode()));
+    QObject::connect(ui->verifyCheck, SIGNAL(toggled(bool)), SLOT(updateVerify()));
 }
 
 FsyncWindow::~FsyncWindow() {
-    if (root)
-        delete root;
+    qDeleteAll(roots);
     delete timer;
     delete ui;
 }
 
+void FsyncWindow::setFolders(const QString& source, const QStringList& destinations) {
+    QStringList others;
+
+    for (auto it = destinations.begin() + 1; it != destinations.end(); ++it)
+        others << QDir(*it).absolutePath();
+
+    ui->sourceEdit->setText(QDir(source).absolutePath());
+    ui->saveEdit->setText(QDir(destinations.first()).absolutePath());
+    ui->destinationEdit->setPlainText(others.join('\n'));
+}
+
+void FsyncWindow::setExcludeRules(const QStringList& rules) {
+    ui->excludeEdit->setPlainText(rules.join('\n'));
+}
+
+void FsyncWindow::setThrottle(int megabytes, int operations, bool idle) {
+    ui->bandwidthSpin->setValue(megabytes);
+    ui->opsSpin->setValue(operations);
+    ui->idleCheck->setChecked(idle);
+}
+
+void FsyncWindow::setSnapshotMode(bool enabled) {
+    ui->snapshotCheck->setChecked(enabled);
+}
+
+void FsyncWindow::setCacheMode(bool drop, bool direct) {
+    ui->dropCacheCheck->setChecked(drop);
+    ui->directCheck->setChecked(direct);
+}
+
+void FsyncWindow::setVerify(bool enabled) {
+    ui->verifyCheck->setChecked(enabled);
+}
+
 void FsyncWindow::browseSourceFolder() {
     disableUi();
     browseFolder(*(ui->sourceEdit), "Select the source folder");
@@ -62,27 +118,63 @@ void FsyncWindow::analyze() {
     cancel = false;
     disableUi();
     QDir srcDir(ui->sourceEdit->text());
-    QDir dstDir(ui->saveEdit->text());
+    QList<QDir> dstDirs;
 
-    if (!srcDir.exists() || !srcDir.isAbsolute()) {
-        QMessageBox::critical(this, "Error", "The source folder path is invalid.");
+    if (!readSettings(srcDir, dstDirs)) {
         enableUi();
         return;
     }
 
-    if (!dstDir.exists() || !dstDir.isAbsolute()) {
-        QMessageBox::critical(this, "Error", "The destination folder path is invalid");
+    // Resuming needs the plan of every destination
+    QStringList pendingPlans;
+
+    snapshots = ui->snapshotCheck->isChecked();
+
+    for (auto it = dstDirs.begin(); !snapshots && it != dstDirs.end(); ++it) {
+        if (Journal::pending(srcDir, *it) && QFile::exists(Plan::location(srcDir, *it)))
+            pendingPlans << Plan::location(srcDir, *it);
+    }
+
+    if (!snapshots && pendingPlans.size() == dstDirs.size() &&
+            QMessageBox::question(this, "Back-up", "An interrupted back-up of these folders was found.\n"
+                                  "Resume it without a new analysis?") == QMessageBox::Yes &&
+            openPlan(pendingPlans)) {
         enableUi();
         return;
     }
 
     resetUi();
 
-    if (root)
-        delete root;
+    QList<Ftree*> trees;
+
+    for (auto it = dstDirs.begin(); it != dstDirs.end(); ++it) {
+        if (!snapshots) {
+            Journal::discard(srcDir, *it);
+            QFile::remove(Plan::location(srcDir, *it));
+            trees.append(new Ftree(srcDir, *it));
+            continue;
+        }
+
+        // A first snapshot is compared against its own, empty, folder
+        Snapshot::discardPartial(*it);
+        QString previous = Snapshot::previous(*it);
+
+        if (previous.isEmpty())
+            previous = Snapshot::create(*it);
+
+        if (previous.isEmpty()) {
+            QMessageBox::critical(this, "Error", "The snapshot folder could not be created in " + it->path());
+            qDeleteAll(trees);
+            enableUi();
+            return;
+        }
+
+        trees.append(new Ftree(srcDir, QDir(previous)));
+    }
 
-    root = new Ftree(srcDir, dstDir);
-    AnalyzeWorker* worker = new AnalyzeWorker(root);
+    setRoots(trees);
+    planPath.clear();
+    AnalyzeWorker* worker = new AnalyzeWorker(roots, &filter);
     QObject::connect(worker, SIGNAL(itemChanged(QString)), SLOT(setCurrentItem(const QString&)));
     QObject::connect(worker, SIGNAL(finished()), SLOT(endAnalyze()));
     QObject::connect(worker, SIGNAL(finished()), worker, SLOT(deleteLater()));
@@ -109,10 +201,11 @@ void FsyncWindow::endAnalyze() {
     QObject::disconnect(timer, SIGNAL(timeout()), this, SLOT(updateTime()));
 
     if (!cancel) {
-        bool changes = root->getChangeCount() > 0;
+        bool changes = getChangeCount() > 0;
 
         if (changes) {
-            createTable(root);
+            for (auto it = roots.begin(); it != roots.end(); ++it)
+                createTable(*it, roots.size() > 1);
         } else {
             ui->diffTable->setRowCount(1);
             ui->diffTable->setItem(0, 0, new QTableWidgetItem("No difference!"));
@@ -122,8 +215,10 @@ void FsyncWindow::endAnalyze() {
         ui->itemLabel->setSizePolicy(QSizePolicy::Preferred, QSizePolicy::Ignored);
         QMessageBox::information(this, "Analysis", "Analysis finished!");
 
-        if (changes)
+        if (changes) {
             ui->saveButton->setEnabled(true);
+            ui->savePlanButton->setEnabled(roots.size() == 1 && !snapshots);
+        }
     }
 
     QObject::connect(ui->analyzeButton, SIGNAL(pressed()), SLOT(analyze()));
@@ -138,7 +233,47 @@ void FsyncWindow::save() {
     disableUi();
     ui->progressBar->setValue(0);
 
-    ApplyWorker* worker = new ApplyWorker(root);
+    snapshotDirs.clear();
+
+    // Each snapshot is built in a new folder, next to the previous one
+    for (auto it = roots.begin(); snapshots && it != roots.end(); ++it) {
+        if (Snapshot::isPartial(*(*it)->getSlave())) {
+            snapshotDirs << *(*it)->getSlave();
+            continue;
+        }
+
+        const QString path = Snapshot::create(QDir(QFileInfo((*it)->getSlave()->absolutePath()).absolutePath()));
+
+        if (path.isEmpty()) {
+            QMessageBox::critical(this, "Error", "The snapshot folder could not be created next to " +
+                                  (*it)->getSlave()->absolutePath());
+            for (auto dit = snapshotDirs.begin(); dit != snapshotDirs.end(); ++dit)
+                dit->removeRecursively();
+            snapshotDirs.clear();
+            ui->saveButton->setEnabled(true);
+            enableUi();
+            return;
+        }
+
+        snapshotDirs << QDir(path);
+    }
+
+    // Keep the plans next to the journals so a crashed back-up can be resumed
+    for (auto it = roots.begin(); !snapshots && it != roots.end(); ++it) {
+        const QString pendingPlan = Plan::location(*(*it)->getMaster(), *(*it)->getSlave());
+
+        if (!QFile::exists(pendingPlan)) {
+            if (!planPath.isEmpty())
+                QFile::copy(planPath, pendingPlan);
+            else
+                Plan::save(*it, filter.getRules(), pendingPlan);
+        }
+    }
+
+    ApplyWorker* worker = new ApplyWorker(roots, &filter);
+    worker->setSnapshots(snapshotDirs);
+    failures.clear();
+    QObject::connect(worker, SIGNAL(failed(QString)), SLOT(addFailure(const QString&)));
     QObject::connect(worker, SIGNAL(progressed()), SLOT(incrProgress()));
     QObject::connect(worker, SIGNAL(itemChanged(QString)), SLOT(setCurrentItem(const QString&)));
     QObject::connect(worker, SIGNAL(finished()), SLOT(endSave()));
@@ -154,7 +289,7 @@ void FsyncWindow::save() {
 
     ui->progressBar->setSizePolicy(QSizePolicy::Preferred, QSizePolicy::Preferred);
     ui->timeLabel->setSizePolicy(QSizePolicy::Preferred, QSizePolicy::Preferred);
-    ui->progressBar->setMaximum(root->getChangeCount());
+    ui->progressBar->setMaximum(getChangeCount());
     worker->start();
     timer->start(1000);
 
@@ -166,22 +301,220 @@ void FsyncWindow::endSave() {
     timer->stop();
     QObject::disconnect(timer, SIGNAL(timeout()), this, SLOT(updateTime()));
 
-    if (!cancel) {
+    bool damaged = false;
+
+    for (auto it = roots.begin(); it != roots.end(); ++it)
+        damaged = damaged || (*it)->isDamaged();
+
+    if (damaged) {
+        // The resume would stop on the same node
+        for (auto it = roots.begin(); !snapshots && it != roots.end(); ++it)
+            QFile::remove(Plan::location(*(*it)->getMaster(), *(*it)->getSlave()));
+
+        QMessageBox::critical(this, "Error", "The plan is damaged, analyse again.");
+    } else if (!cancel) {
+        QStringList incomplete;
+
+        for (auto it = roots.begin(); !snapshots && it != roots.end(); ++it)
+            QFile::remove(Plan::location(*(*it)->getMaster(), *(*it)->getSlave()));
+
+        // A snapshot missing files would become the base of the next ones,
+        // it stays partial and is discarded by the next analysis
+        for (auto it = snapshotDirs.begin(); it != snapshotDirs.end(); ++it) {
+            const QString prefix = it->absolutePath() + "/";
+            bool complete = true;
+
+            for (auto fit = failures.begin(); complete && fit != failures.end(); ++fit)
+                complete = !fit->startsWith(prefix);
+
+            if (complete)
+                Snapshot::complete(*it);
+            else
+                incomplete << it->absolutePath();
+        }
+
         ui->progressBar->setValue(ui->progressBar->maximum());
         ui->itemLabel->setSizePolicy(QSizePolicy::Preferred, QSizePolicy::Ignored);
-        QMessageBox::information(this, "Back-up", "Back-up finished!");
+        if (failures.isEmpty())
+            QMessageBox::information(this, "Back-up", "Back-up finished!");
+        else
+            QMessageBox::warning(this, "Back-up", "Back-up finished, but " + QString::number(failures.size()) +
+                                 " files could not be copied or verified:\n" +
+                                 QStringList(failures.mid(0, FAILURES_SHOWN)).join('\n') +
+                                 (failures.size() > FAILURES_SHOWN ? "\n..." : "") +
+                                 (incomplete.isEmpty() ? QString() :
+                                  "\n\nThese snapshots were left incomplete and will be discarded:\n" +
+                                  incomplete.join('\n')));
+    } else if (snapshots) {
+        QMessageBox::information(this, "Back-up", "Snapshot canceled, it will be discarded by the next analysis");
     } else {
-        QMessageBox::information(this, "Back-up", "Back-up canceled, please restart an analysis");
+        QMessageBox::information(this, "Back-up", "Back-up canceled, it can be resumed without a new analysis");
     }
 
     QObject::connect(ui->saveButton, SIGNAL(pressed()), SLOT(save()));
     QObject::disconnect(ui->saveButton, SIGNAL(pressed()), this, SLOT(cancelSave()));
 
-    ui->saveButton->setText("Start back-up");
-    ui->saveButton->setDisabled(true);
+    ui->saveButton->setText(cancel && !snapshots ? "Resume back-up" : "Start back-up");
+    ui->saveButton->setEnabled(cancel && !snapshots);
+    ui->savePlanButton->setEnabled(cancel && !snapshots && roots.size() == 1);
+    enableUi();
+}
+
+void FsyncWindow::watch() {
+    cancel = false;
+    disableUi();
+    QDir srcDir(ui->sourceEdit->text());
+    QList<QDir> dstDirs;
+
+    if (!readSettings(srcDir, dstDirs)) {
+        enableUi();
+        return;
+    }
+
+    if (ui->snapshotCheck->isChecked()) {
+        QMessageBox::critical(this, "Error", "Snapshots are made by back-ups, they cannot be watched.");
+        enableUi();
+        return;
+    }
+
+    resetUi();
+    snapshots = false;
+
+    QList<Ftree*> trees;
+
+    for (auto it = dstDirs.begin(); it != dstDirs.end(); ++it)
+        trees.append(new Ftree(srcDir, *it));
+
+    setRoots(trees);
+    planPath.clear();
+    WatchWorker* worker = new WatchWorker(roots, &filter);
+    QObject::connect(worker, SIGNAL(itemChanged(QString)), SLOT(setCurrentItem(const QString&)));
+    QObject::connect(worker, SIGNAL(synchronized()), SLOT(watchSynchronized()));
+    QObject::connect(worker, SIGNAL(finished()), SLOT(endWatch()));
+    QObject::connect(worker, SIGNAL(finished()), worker, SLOT(deleteLater()));
+
+    QObject::disconnect(ui->watchButton, SIGNAL(pressed()), this, SLOT(watch()));
+    QObject::connect(ui->watchButton, SIGNAL(pressed()), SLOT(cancelWatch()));
+    QObject::connect(ui->watchButton, SIGNAL(pressed()), worker, SLOT(cancelWork()));
+
+    QObject::connect(timer, SIGNAL(timeout()), SLOT(updateTime()));
+    time = -1;
+    updateTime();
+
+    ui->timeLabel->setSizePolicy(QSizePolicy::Preferred, QSizePolicy::Preferred);
+    setCurrentItem("Initial synchronization of " + srcDir.absolutePath());
+    worker->start();
+    timer->start(1000);
+
+    ui->watchButton->setText("Stop watching");
+    ui->watchButton->setEnabled(true);
+}
+
+void FsyncWindow::endWatch() {
+    timer->stop();
+    QObject::disconnect(timer, SIGNAL(timeout()), this, SLOT(updateTime()));
+
+    QObject::connect(ui->watchButton, SIGNAL(pressed()), SLOT(watch()));
+    QObject::disconnect(ui->watchButton, SIGNAL(pressed()), this, SLOT(cancelWatch()));
+
+    ui->itemLabel->setSizePolicy(QSizePolicy::Preferred, QSizePolicy::Ignored);
+    ui->watchButton->setText("Start watching");
+    enableUi();
+}
+
+void FsyncWindow::watchSynchronized() {
+    setCurrentItem("Watching, last synchronization at " + QTime::currentTime().toString());
+}
+
+// The deduplicated store does not need an analysis: unchanged files are
+// recognized by their manifest
+void FsyncWindow::dedup() {
+    cancel = false;
+    disableUi();
+    QDir srcDir(ui->sourceEdit->text());
+    QList<QDir> dstDirs;
+
+    if (!readSettings(srcDir, dstDirs)) {
+        enableUi();
+        return;
+    }
+
+    if (dstDirs.size() > 1 || ui->snapshotCheck->isChecked()) {
+        QMessageBox::critical(this, "Error", "A deduplicated back-up has a single destination, without snapshots.");
+        enableUi();
+        return;
+    }
+
+    if (!ChunkStore::isStore(dstDirs.first()) &&
+            !dstDirs.first().entryList(QDir::AllEntries | QDir::NoDotAndDotDot).isEmpty() &&
+            QMessageBox::question(this, "Deduplicated back-up", "The destination folder is not empty.\n"
+                                  "Create a deduplicated store in it anyway?") != QMessageBox::Yes) {
+        enableUi();
+        return;
+    }
+
+    resetUi();
+    failures.clear();
+    dedupRead = dedupNew = 0;
+
+    DedupWorker* worker = new DedupWorker(srcDir, dstDirs.first(), &filter);
+    QObject::connect(worker, SIGNAL(itemChanged(QString)), SLOT(setCurrentItem(const QString&)));
+    QObject::connect(worker, SIGNAL(failed(QString)), SLOT(addFailure(const QString&)));
+    QObject::connect(worker, SIGNAL(stored(qint64, qint64)), SLOT(dedupStored(qint64, qint64)));
+    QObject::connect(worker, SIGNAL(finished()), SLOT(endDedup()));
+    QObject::connect(worker, SIGNAL(finished()), worker, SLOT(deleteLater()));
+
+    QObject::disconnect(ui->dedupButton, SIGNAL(pressed()), this, SLOT(dedup()));
+    QObject::connect(ui->dedupButton, SIGNAL(pressed()), SLOT(cancelDedup()));
+    QObject::connect(ui->dedupButton, SIGNAL(pressed()), worker, SLOT(cancelWork()));
+
+    QObject::connect(timer, SIGNAL(timeout()), SLOT(updateTime()));
+    time = -1;
+    updateTime();
+
+    ui->timeLabel->setSizePolicy(QSizePolicy::Preferred, QSizePolicy::Preferred);
+    worker->start();
+    timer->start(1000);
+
+    ui->dedupButton->setText("Cancel");
+    ui->dedupButton->setEnabled(true);
+}
+
+void FsyncWindow::endDedup() {
+    timer->stop();
+    QObject::disconnect(timer, SIGNAL(timeout()), this, SLOT(updateTime()));
+
+    if (cancel) {
+        QMessageBox::information(this, "Deduplicated back-up", "Back-up canceled, stored files are kept");
+    } else {
+        QString text = "Back-up finished: " + QString::number(dedupRead/(1024*1024)) + " MB read, " +
+                       QString::number(dedupNew/(1024*1024)) + " MB of new chunks stored";
+
+        if (dedupNew > 0)
+            text += " (deduplication ratio " + QString::number(double(dedupRead)/dedupNew, 'f', 2) + ")";
+
+        if (failures.isEmpty())
+            QMessageBox::information(this, "Deduplicated back-up", text);
+        else
+            QMessageBox::warning(this, "Deduplicated back-up", text + "\n" + QString::number(failures.size()) +
+                                 " files could not be stored:\n" +
+                                 QStringList(failures.mid(0, FAILURES_SHOWN)).join('\n') +
+                                 (failures.size() > FAILURES_SHOWN ? "\n..." : ""));
+    }
+
+    QObject::connect(ui->dedupButton, SIGNAL(pressed()), SLOT(dedup()));
+    QObject::disconnect(ui->dedupButton, SIGNAL(pressed()), this, SLOT(cancelDedup()));
+
+    ui->itemLabel->setSizePolicy(QSizePolicy::Preferred, QSizePolicy::Ignored);
+    ui->dedupButton->setText("Deduplicated back-up");
     enableUi();
 }
 
+void FsyncWindow::dedupStored(qint64 read, qint64 stored) {
+    dedupRead = read;
+    dedupNew = stored;
+}
+
 void FsyncWindow::cancelAnalyze() {
     ui->analyzeButton->setDisabled(true);
     ui->analyzeButton->setText("Canceling...");
@@ -194,6 +527,58 @@ void FsyncWindow::cancelSave() {
     cancel = true;
 }
 
+void FsyncWindow::cancelWatch() {
+    ui->watchButton->setDisabled(true);
+    ui->watchButton->setText("Stopping...");
+    cancel = true;
+}
+
+void FsyncWindow::cancelDedup() {
+    ui->dedupButton->setDisabled(true);
+    ui->dedupButton->setText("Canceling...");
+    cancel = true;
+}
+
+void FsyncWindow::savePlan() {
+    QString path = QFileDialog::getSaveFileName(this, "Save the analysis",
+                                                QDir::homePath(), "Fsync analysis (*.fsplan)");
+
+    if (path.isEmpty())
+        return;
+
+    if (!path.endsWith(".fsplan"))
+        path += ".fsplan";
+
+    if (!Plan::save(roots.first(), filter.getRules(), path))
+        QMessageBox::critical(this, "Error", "The analysis could not be saved.");
+}
+
+void FsyncWindow::loadPlan() {
+    const QString path = QFileDialog::getOpenFileName(this, "Load an analysis",
+                                                      QDir::homePath(), "Fsync analysis (*.fsplan)");
+
+    if (!path.isEmpty())
+        openPlan(QStringList(path));
+}
+
+void FsyncWindow::updateThrottle() {
+    RateLimiter::instance().setLimits(qint64(ui->bandwidthSpin->value())*1024*1024,
+                                      ui->opsSpin->value());
+    RateLimiter::instance().setIdlePriority(ui->idleCheck->isChecked());
+}
+
+void FsyncWindow::updateCacheMode() {
+    StreamFile::setCacheMode(ui->dropCacheCheck->isChecked(), ui->directCheck->isChecked());
+}
+
+void FsyncWindow::updateVerify() {
+    FileCopier::setVerify(ui->verifyCheck->isChecked());
+}
+
+void FsyncWindow::addFailure(const QString& path) {
+    failures << path;
+}
+
 void FsyncWindow::incrProgress() {
     ui->progressBar->setValue(ui->progressBar->value() + 1);
 }
@@ -206,16 +591,25 @@ void FsyncWindow::setCurrentItem(const QString& text) {
 void FsyncWindow::disableUi() {
     ui->analyzeButton->setDisabled(true);
     ui->saveButton->setDisabled(true);
+    ui->savePlanButton->setDisabled(true);
+    ui->loadPlanButton->setDisabled(true);
+    ui->watchButton->setDisabled(true);
+    ui->dedupButton->setDisabled(true);
     ui->sourceBrowse->setDisabled(true);
     ui->saveBrowse->setDisabled(true);
-    ui->settingsTab->setDisabled(true);
+    ui->filterGroup->setDisabled(true);
+    ui->destinationGroup->setDisabled(true);
 }
 
 void FsyncWindow::enableUi() {
     ui->analyzeButton->setEnabled(true);
+    ui->loadPlanButton->setEnabled(true);
+    ui->watchButton->setEnabled(true);
+    ui->dedupButton->setEnabled(true);
     ui->sourceBrowse->setEnabled(true);
     ui->saveBrowse->setEnabled(true);
-    ui->settingsTab->setEnabled(true);
+    ui->filterGroup->setEnabled(true);
+    ui->destinationGroup->setEnabled(true);
 }
 
 void FsyncWindow::updateTime() {
@@ -239,12 +633,54 @@ void FsyncWindow::resetUi() {
     ui->diffTable->setColumnCount(3);
     ui->diffTable->setHorizontalHeaderLabels(QStringList() << "" << "Source" << "Destination");
 
+    ui->saveButton->setText("Start back-up");
     ui->saveButton->setDisabled(true);
+    ui->savePlanButton->setDisabled(true);
     ui->itemLabel->setSizePolicy(QSizePolicy::Preferred, QSizePolicy::Ignored);
     ui->progressBar->setSizePolicy(QSizePolicy::Preferred, QSizePolicy::Ignored);
     ui->timeLabel->setSizePolicy(QSizePolicy::Preferred, QSizePolicy::Ignored);
 }
 
+bool FsyncWindow::readSettings(QDir& srcDir, QList<QDir>& dstDirs) {
+    const QStringList others = ui->destinationEdit->toPlainText().split('\n');
+
+    if (!srcDir.exists() || !srcDir.isAbsolute()) {
+        QMessageBox::critical(this, "Error", "The source folder path is invalid.");
+        return false;
+    }
+
+    dstDirs.clear();
+    dstDirs << QDir(ui->saveEdit->text());
+
+    for (auto it = others.begin(); it != others.end(); ++it) {
+        if (!it->trimmed().isEmpty())
+            dstDirs << QDir(it->trimmed());
+    }
+
+    for (int i = 0; i < dstDirs.size(); ++i) {
+        if (!dstDirs.at(i).exists() || !dstDirs.at(i).isAbsolute()) {
+            QMessageBox::critical(this, "Error", "The destination folder path is invalid: " + dstDirs.at(i).path());
+            return false;
+        }
+
+        for (int j = 0; j < i; ++j) {
+            if (dstDirs.at(j).absolutePath() == dstDirs.at(i).absolutePath()) {
+                QMessageBox::critical(this, "Error", "The destination folder is listed twice: " + dstDirs.at(i).path());
+                return false;
+            }
+        }
+    }
+
+    filter = Filter(ui->excludeEdit->toPlainText().split('\n'));
+
+    if (!filter.getErrors().isEmpty()) {
+        QMessageBox::critical(this, "Error", "Invalid exclusion rules:\n" + filter.getErrors().join('\n'));
+        return false;
+    }
+
+    return true;
+}
+
 void FsyncWindow::browseFolder(QLineEdit& line, const char* msg) {
     QDir defaultDir(line.text());
     QString dir;
@@ -279,7 +715,9 @@ void FsyncWindow::addRow(QTableWidgetItem* t1, QTableWidgetItem* t2, QTableWidge
        ui->diffTable->setItem(rowCount, 2, t3);
 }
 
-void FsyncWindow::createTable(Ftree* tree) {
+// With several destinations, additions also show the destination they
+// are copied to
+void FsyncWindow::createTable(Ftree* tree, bool showSlave) {
     QTableWidgetItem *signItem, *textItem;
 
     for (auto it = tree->getDirList()->begin(); it != tree->getDirList()->end(); ++it) {
@@ -288,7 +726,7 @@ void FsyncWindow::createTable(Ftree* tree) {
         textItem = new QTableWidgetItem(it->absoluteFilePath());
         textItem->setBackgroundColor(Qt::green);
 
-        addRow(signItem, textItem, nullptr);
+        addRow(signItem, textItem, showSlave ? new QTableWidgetItem(tree->getSlave()->filePath(it->fileName())) : nullptr);
     }
 
     for (auto it = tree->getFileList()->begin(); it != tree->getFileList()->end(); ++it) {
@@ -297,7 +735,7 @@ void FsyncWindow::createTable(Ftree* tree) {
         textItem = new QTableWidgetItem(it->absoluteFilePath());
         textItem->setBackgroundColor(Qt::green);
 
-        addRow(signItem, textItem, nullptr);
+        addRow(signItem, textItem, showSlave ? new QTableWidgetItem(tree->getSlave()->filePath(it->fileName())) : nullptr);
     }
 
     for (auto it = tree->getRemList()->begin(); it != tree->getRemList()->end(); ++it) {
@@ -310,5 +748,83 @@ void FsyncWindow::createTable(Ftree* tree) {
     }
 
     for (auto it = tree->getChildren()->begin(); it != tree->getChildren()->end(); ++it)
-        createTable(*it);
+        createTable(*it, showSlave);
+}
+
+// Several plans are opened together to resume a back-up to several
+// destinations, they share the source and the exclusion rules
+bool FsyncWindow::openPlan(const QStringList& paths) {
+    QList<Ftree*> trees;
+    QStringList rules, destinations;
+    QString error;
+
+    for (auto it = paths.begin(); it != paths.end(); ++it) {
+        Ftree* tree = Plan::load(*it, it == paths.begin() ? &rules : nullptr, &error);
+
+        if (!tree) {
+            qDeleteAll(trees);
+            QMessageBox::critical(this, "Error", error);
+            return false;
+        }
+
+        trees.append(tree);
+        destinations << tree->getSlave()->absolutePath();
+    }
+
+    resetUi();
+    setRoots(trees);
+    snapshots = false;
+    ui->snapshotCheck->setChecked(false);
+    planPath = paths.size() == 1 ? paths.first() : QString();
+    filter = Filter(rules);
+    setExcludeRules(rules);
+    setFolders(roots.first()->getMaster()->absolutePath(), destinations);
+
+    // Listing every change would decode the whole plan up front
+    const int changes = getChangeCount();
+
+    if (changes > TABLE_MAX_CHANGES) {
+        ui->diffTable->setRowCount(1);
+        ui->diffTable->setItem(0, 0, new QTableWidgetItem(QString::number(changes) + " changes"));
+    } else if (changes > 0) {
+        for (auto it = roots.begin(); it != roots.end(); ++it)
+            createTable(*it, roots.size() > 1);
+    } else {
+        ui->diffTable->setRowCount(1);
+        ui->diffTable->setItem(0, 0, new QTableWidgetItem("No difference!"));
+    }
+
+    // Only a listed plan has been decoded, others are checked while applied
+    bool damaged = false;
+
+    for (auto it = roots.begin(); it != roots.end(); ++it)
+        damaged = damaged || (*it)->isDamaged();
+
+    if (damaged) {
+        QMessageBox::critical(this, "Error", "The plan is damaged, analyse again.");
+        return false;
+    }
+
+    if (changes > 0) {
+        if (Journal::pending(*roots.first()->getMaster(), *roots.first()->getSlave()))
+            ui->saveButton->setText("Resume back-up");
+        ui->saveButton->setEnabled(true);
+        ui->savePlanButton->setEnabled(roots.size() == 1);
+    }
+
+    return true;
+}
+
+void FsyncWindow::setRoots(const QList<Ftree*>& trees) {
+    qDeleteAll(roots);
+    roots = trees;
+}
+
+int FsyncWindow::getChangeCount() const {
+    int changes = 0;
+
+    for (auto it = roots.begin(); it != roots.end(); ++it)
+        changes += (*it)->getChangeCount();
+
+    return changes;
 }
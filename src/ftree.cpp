@@ -13,10 +13,16 @@
 *   limitations under the License.
 */
 #include "ftree.h"
+#include "plan.h"
 
 Ftree::Ftree(const QDir& master, const QDir& slave) :
     master(master), slave(slave),
-    toAddDirs(nullptr), toAddFiles(nullptr), toRemove(nullptr)
+    toAddDirs(nullptr), toAddFiles(nullptr), toRemove(nullptr), planNode(0), damaged(false)
+{}
+
+Ftree::Ftree(const QDir& master, const QDir& slave, QSharedPointer<const Plan> plan, quint64 node) :
+    master(master), slave(slave),
+    toAddDirs(nullptr), toAddFiles(nullptr), toRemove(nullptr), plan(plan), planNode(node), damaged(false)
 {}
 
 Ftree::~Ftree() {
@@ -34,6 +40,9 @@ Ftree::~Ftree() {
 int Ftree::getChangeCount() {
     int count = 0;
 
+    if (plan)
+        return plan->changeCount(planNode);
+
     if (toAddDirs)
         count += toAddDirs->size();
     if (toAddFiles)
@@ -51,15 +60,37 @@ void Ftree::addChild(Ftree* child) {
     children.push_back(child);
 }
 
+void Ftree::removeChild(Ftree* child) {
+    children.removeOne(child);
+    delete child;
+}
+
+void Ftree::clearChanges() {
+    load();
+
+    if (toAddDirs)
+        toAddDirs->clear();
+    if (toAddFiles)
+        toAddFiles->clear();
+    if (toRemove)
+        toRemove->clear();
+
+    for (auto it = children.begin(); it != children.end(); ++it)
+        (*it)->clearChanges();
+}
+
 void Ftree::setDirList(std::list<QFileInfo>* list) {
+    delete toAddDirs;
     toAddDirs = list;
 }
 
 void Ftree::setFileList(std::list<QFileInfo>* list) {
+    delete toAddFiles;
     toAddFiles = list;
 }
 
 void Ftree::setRemList(std::list<QFileInfo>* list) {
+    delete toRemove;
     toRemove = list;
 }
 
@@ -72,18 +103,48 @@ const QDir* Ftree::getSlave() const {
 }
 
 const QList<Ftree*>* Ftree::getChildren() const {
+    load();
     return &children;
 }
 
 
 const std::list<QFileInfo>* Ftree::getDirList() const {
+    load();
     return toAddDirs;
 }
 
 const std::list<QFileInfo>* Ftree::getFileList() const {
+    load();
     return toAddFiles;
 }
 
 const std::list<QFileInfo>* Ftree::getRemList() const {
+    load();
     return toRemove;
 }
+
+// Nodes read from a plan file are only decoded when first visited
+void Ftree::load() const {
+    if (!plan)
+        return;
+
+    Ftree* self = const_cast<Ftree*>(this);
+    QSharedPointer<const Plan> source = self->plan;
+
+    self->plan.clear();
+    self->damaged = !source->decode(planNode, self);
+}
+
+// Only the nodes decoded so far are checked, a damaged node is left
+// without changes
+bool Ftree::isDamaged() const {
+    if (damaged)
+        return true;
+
+    for (auto it = children.begin(); it != children.end(); ++it) {
+        if ((*it)->isDamaged())
+            return true;
+    }
+
+    return false;
+}
@@ -0,0 +1,163 @@
+/*Copyright 2017 Pierre Franco
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+#include <QCryptographicHash>
+#include <QStandardPaths>
+#include "journal.h"
+#include "varint.h"
+
+#ifdef Q_OS_LINUX
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define JOURNAL_MAGIC "FSJ1"
+#define JOURNAL_BATCH_COUNT 1024
+#define JOURNAL_BATCH_BYTES (64*1024)
+#define JOURNAL_BATCH_MSECS 1000
+
+Journal::Journal(const QDir& master, const QDir& slave) :
+    slave(slave), file(location(master, slave)), batchCount(0)
+{}
+
+Journal::~Journal() {
+    if (file.isOpen()) {
+        commit();
+        file.close();
+    }
+}
+
+bool Journal::open() {
+    QDir().mkpath(QFileInfo(file.fileName()).absolutePath());
+
+    if (!file.open(QIODevice::ReadWrite))
+        return false;
+
+    if (file.size() == 0)
+        file.write(JOURNAL_MAGIC);
+    else
+        load();
+
+    file.seek(file.size());
+    lastCommit.start();
+
+    return true;
+}
+
+void Journal::commit() {
+    if (batch.isEmpty() || !file.isOpen())
+        return;
+
+    syncSlave();
+
+    file.write(batch);
+    file.flush();
+#ifdef Q_OS_LINUX
+    fdatasync(file.handle());
+#endif
+
+    batch.clear();
+    batchCount = 0;
+    lastCommit.restart();
+}
+
+void Journal::finish() {
+    batch.clear();
+    batchCount = 0;
+
+    if (file.isOpen())
+        file.close();
+
+    file.remove();
+}
+
+bool Journal::isDone(Operation op, const QString& path) const {
+    return done.contains(key(op, path));
+}
+
+void Journal::record(Operation op, const QString& path) {
+    const QByteArray name = slave.relativeFilePath(path).toUtf8();
+
+    batch.append(char(op));
+    appendVarint(batch, name.size());
+    batch.append(name);
+    ++batchCount;
+
+    if (batchCount >= JOURNAL_BATCH_COUNT || batch.size() >= JOURNAL_BATCH_BYTES ||
+            lastCommit.elapsed() >= JOURNAL_BATCH_MSECS)
+        commit();
+}
+
+QString Journal::location(const QDir& master, const QDir& slave, const QString& extension) {
+    const QByteArray id = QCryptographicHash::hash(
+                (master.absolutePath() + "\n" + slave.absolutePath()).toUtf8(),
+                QCryptographicHash::Sha1).toHex();
+
+    return QStandardPaths::writableLocation(QStandardPaths::AppDataLocation) +
+            "/journals/" + QString::fromLatin1(id) + extension;
+}
+
+bool Journal::pending(const QDir& master, const QDir& slave) {
+    return QFile::exists(location(master, slave));
+}
+
+void Journal::discard(const QDir& master, const QDir& slave) {
+    QFile::remove(location(master, slave));
+}
+
+QByteArray Journal::key(Operation op, const QString& path) const {
+    return char(op) + slave.relativeFilePath(path).toUtf8();
+}
+
+void Journal::load() {
+    const QByteArray data = file.readAll();
+    const uchar* begin = reinterpret_cast<const uchar*>(data.constData());
+    const uchar* end = begin + data.size();
+    const uchar* pos = begin + qstrlen(JOURNAL_MAGIC);
+    qint64 valid = pos - begin;
+
+    if (!data.startsWith(JOURNAL_MAGIC)) {
+        file.resize(0);
+        file.write(JOURNAL_MAGIC);
+        return;
+    }
+
+    // A crash may leave a truncated record at the end, it is dropped
+    while (pos < end) {
+        const uchar op = *pos++;
+        quint64 length;
+
+        if (!readVarint(pos, end, length) || length > quint64(end - pos))
+            break;
+
+        done.insert(char(op) + QByteArray(reinterpret_cast<const char*>(pos), int(length)));
+        pos += length;
+        valid = pos - begin;
+    }
+
+    if (valid != data.size())
+        file.resize(valid);
+}
+
+void Journal::syncSlave() {
+#ifdef Q_OS_LINUX
+    const int fd = ::open(QFile::encodeName(slave.absolutePath()).constData(),
+                          O_RDONLY | O_DIRECTORY);
+
+    if (fd >= 0) {
+        syncfs(fd);
+        ::close(fd);
+    }
+#endif
+}
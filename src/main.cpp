@@ -12,13 +12,120 @@
 *   See the License for the specific language governing permissions and
 *   limitations under the License.
 */
+#include "benchmark.h"
+#include "chunkstore.h"
 #include "fsyncwindow.h"
 #include <QApplication>
+#include <QCommandLineParser>
+#include <QFile>
+#include <QTextStream>
 
 int main(int argc, char *argv[])
 {
 	QApplication a(argc, argv);
+	QApplication::setApplicationVersion(FSYNCVERSION);
+
+	QCommandLineParser parser;
+	parser.setApplicationDescription("Local master-slave folder synchronization");
+	parser.addHelpOption();
+	parser.addVersionOption();
+	parser.addPositionalArgument("source", "Source folder");
+	parser.addPositionalArgument("destination", "Destination folders, updated in a single pass",
+			"destination...");
+
+	QCommandLineOption excludeOption(QStringList() << "e" << "exclude",
+			"Exclude paths matching <rule> (.gitignore syntax, \"re:\" for a regular expression).",
+			"rule");
+	QCommandLineOption excludeFromOption("exclude-from",
+			"Read exclusion rules from <file>, one per line.", "file");
+	QCommandLineOption bandwidthOption("bwlimit",
+			"Limit disk traffic (reads and writes) to <MB/s>.", "MB/s", "0");
+	QCommandLineOption opsOption("opslimit",
+			"Limit file operations to <ops/s>.", "ops/s", "0");
+	QCommandLineOption idleOption("idle", "Use the idle I/O priority class.");
+	QCommandLineOption snapshotOption("snapshot",
+			"Keep each back-up in a dated folder of the destinations, hardlinking unchanged files.");
+	QCommandLineOption dropCacheOption("drop-cache",
+			"Drop file pages from the cache once used and write behind the copy.");
+	QCommandLineOption directOption("direct-io", "Bypass the page cache with direct I/O.");
+	QCommandLineOption restoreOption("restore",
+			"Rebuild the files of the deduplicated store <source> into <destination>, then exit.");
+	QCommandLineOption verifyOption("verify", "Verify copies by reading them back from the disk.");
+	QCommandLineOption benchmarkOption("benchmark",
+			"Run the <name> benchmark (filter, stream, dedup) in the scratch folder given as source, then exit.",
+			"name");
+	parser.addOption(excludeOption);
+	parser.addOption(excludeFromOption);
+	parser.addOption(bandwidthOption);
+	parser.addOption(opsOption);
+	parser.addOption(idleOption);
+	parser.addOption(snapshotOption);
+	parser.addOption(dropCacheOption);
+	parser.addOption(directOption);
+	parser.addOption(verifyOption);
+	parser.addOption(restoreOption);
+	parser.addOption(benchmarkOption);
+	parser.process(a);
+
+	if (parser.isSet(benchmarkOption)) {
+		QString error;
+
+		if (!Benchmark::run(parser.value(benchmarkOption), parser.positionalArguments(), &error)) {
+			QTextStream(stderr) << error << "\n";
+			return 1;
+		}
+
+		return 0;
+	}
+
+	if (parser.isSet(restoreOption)) {
+		const QStringList paths = parser.positionalArguments();
+		QString error;
+
+		if (paths.size() != 2) {
+			QTextStream(stderr) << "--restore needs a store and a destination folder\n";
+			return 1;
+		}
+
+		ChunkStore store((QDir(paths.at(0))));
+
+		if (!store.open(false, &error) || !store.restore(QDir(paths.at(1)), &error)) {
+			QTextStream(stderr) << error << "\n";
+			return 1;
+		}
+
+		return 0;
+	}
+
+	QStringList rules;
+	const QStringList files = parser.values(excludeFromOption);
+
+	for (auto it = files.begin(); it != files.end(); ++it) {
+		QFile file(*it);
+
+		if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+			QTextStream(stderr) << "Cannot read " << *it << "\n";
+			return 1;
+		}
+
+		rules << QString::fromUtf8(file.readAll()).split('\n');
+	}
+
+	rules << parser.values(excludeOption);
+
 	FsyncWindow w;
+	const QStringList folders = parser.positionalArguments();
+
+	if (folders.size() >= 2)
+		w.setFolders(folders.at(0), folders.mid(1));
+	if (!rules.isEmpty())
+		w.setExcludeRules(rules);
+	w.setThrottle(parser.value(bandwidthOption).toInt(), parser.value(opsOption).toInt(),
+			parser.isSet(idleOption));
+	w.setSnapshotMode(parser.isSet(snapshotOption));
+	w.setCacheMode(parser.isSet(dropCacheOption), parser.isSet(directOption));
+	w.setVerify(parser.isSet(verifyOption));
+
 	w.show();
 
 	return a.exec();
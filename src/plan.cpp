@@ -0,0 +1,335 @@
+/*Copyright 2017 Pierre Franco
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+#include <algorithm>
+#include <cstring>
+#include <QHash>
+#include <QList>
+#include <QSaveFile>
+#include "ftree.h"
+#include "journal.h"
+#include "plan.h"
+#include "varint.h"
+
+#define PLAN_MAGIC "FSPL"
+#define PLAN_VERSION 2
+#define PLAN_HEADER_SIZE 48
+
+static void appendFixed(QByteArray& out, quint64 value, int bytes) {
+    for (int i = 0; i < bytes; ++i)
+        out.append(char(value >> (8*i)));
+}
+
+static quint64 readFixed(const uchar* pos, int bytes) {
+    quint64 value = 0;
+
+    for (int i = 0; i < bytes; ++i)
+        value |= quint64(pos[i]) << (8*i);
+
+    return value;
+}
+
+static void appendString(QByteArray& out, const QString& str) {
+    const QByteArray utf8 = str.toUtf8();
+
+    appendVarint(out, utf8.size());
+    out.append(utf8);
+}
+
+static bool readString(const uchar*& pos, const uchar* end, QString& str) {
+    quint64 length;
+
+    if (!readVarint(pos, end, length) || length > quint64(end - pos))
+        return false;
+
+    str = QString::fromUtf8(reinterpret_cast<const char*>(pos), int(length));
+    pos += length;
+
+    return true;
+}
+
+static quint64 poolName(QByteArray& pool, QHash<QString, quint64>& ids, const QString& name) {
+    auto it = ids.constFind(name);
+
+    if (it != ids.constEnd())
+        return it.value();
+
+    const quint64 id = pool.size();
+
+    appendString(pool, name);
+    ids.insert(name, id);
+
+    return id;
+}
+
+static void appendNames(QByteArray& out, QByteArray& pool, QHash<QString, quint64>& ids,
+                        const std::list<QFileInfo>* list) {
+    if (!list) {
+        appendVarint(out, 0);
+        return;
+    }
+
+    appendVarint(out, list->size());
+
+    for (auto it = list->begin(); it != list->end(); ++it)
+        appendVarint(out, poolName(pool, ids, it->fileName()));
+}
+
+static quint64 writeNode(Ftree* tree, QByteArray& nodes, QByteArray& pool,
+                         QHash<QString, quint64>& ids, int& changes) {
+    const QList<Ftree*>* children = tree->getChildren();
+    QList<quint64> childNodes;
+    int count = 0;
+
+    for (auto it = children->begin(); it != children->end(); ++it)
+        childNodes.append(writeNode(*it, nodes, pool, ids, count));
+
+    if (tree->getDirList())
+        count += tree->getDirList()->size();
+    if (tree->getFileList())
+        count += tree->getFileList()->size();
+    if (tree->getRemList())
+        count += tree->getRemList()->size();
+
+    const quint64 offset = nodes.size();
+
+    appendVarint(nodes, count);
+    appendNames(nodes, pool, ids, tree->getDirList());
+    appendNames(nodes, pool, ids, tree->getFileList());
+    appendNames(nodes, pool, ids, tree->getRemList());
+
+    appendVarint(nodes, children->size());
+    for (int i = 0; i < children->size(); ++i) {
+        appendVarint(nodes, poolName(pool, ids, children->at(i)->getMaster()->dirName()));
+        appendVarint(nodes, childNodes.at(i));
+    }
+
+    changes += count;
+
+    return offset;
+}
+
+Plan::Plan(const QString& path) :
+    file(path), data(nullptr), size(0), poolOffset(0), poolSize(0), nodesOffset(0)
+{}
+
+Plan::~Plan() {
+    if (file.isOpen())
+        file.close();
+}
+
+bool Plan::save(Ftree* root, const QStringList& rules, const QString& path) {
+    QByteArray header, paths, pool, nodes;
+    QHash<QString, quint64> ids;
+    int changes = 0;
+
+    const quint64 rootNode = writeNode(root, nodes, pool, ids, changes);
+
+    appendString(paths, root->getMaster()->absolutePath());
+    appendString(paths, root->getSlave()->absolutePath());
+    appendVarint(paths, rules.size());
+    for (auto it = rules.begin(); it != rules.end(); ++it)
+        appendString(paths, *it);
+
+    const quint64 poolStart = PLAN_HEADER_SIZE + paths.size();
+
+    header.append(PLAN_MAGIC);
+    appendFixed(header, PLAN_VERSION, 4);
+    appendFixed(header, poolStart, 8);
+    appendFixed(header, pool.size(), 8);
+    appendFixed(header, poolStart + pool.size(), 8);
+    appendFixed(header, rootNode, 8);
+    appendFixed(header, changes, 8);
+
+    QDir().mkpath(QFileInfo(path).absolutePath());
+    QSaveFile out(path);
+
+    if (!out.open(QIODevice::WriteOnly))
+        return false;
+
+    out.write(header);
+    out.write(paths);
+    out.write(pool);
+    out.write(nodes);
+
+    return out.commit();
+}
+
+Ftree* Plan::load(const QString& path, QStringList* rules, QString* error) {
+    QSharedPointer<Plan> plan(new Plan(path));
+    QString master, slave, rule;
+    quint64 ruleCount = 0;
+
+    if (!plan->file.open(QIODevice::ReadOnly)) {
+        if (error)
+            *error = "Cannot open " + path;
+        return nullptr;
+    }
+
+    plan->size = plan->file.size();
+
+    if (plan->size < PLAN_HEADER_SIZE) {
+        if (error)
+            *error = path + " is not a plan file";
+        return nullptr;
+    }
+
+    plan->data = plan->file.map(0, plan->size);
+
+    if (!plan->data) {
+        plan->buffer = plan->file.readAll();
+        plan->data = reinterpret_cast<const uchar*>(plan->buffer.constData());
+    }
+
+    if (std::memcmp(plan->data, PLAN_MAGIC, 4) != 0) {
+        if (error)
+            *error = path + " is not a plan file";
+        return nullptr;
+    }
+
+    const quint64 version = readFixed(plan->data + 4, 4);
+
+    if (version < 1 || version > PLAN_VERSION) {
+        if (error)
+            *error = path + " was written by an unsupported version of fsync";
+        return nullptr;
+    }
+
+    plan->poolOffset = readFixed(plan->data + 8, 8);
+    plan->poolSize = readFixed(plan->data + 16, 8);
+    plan->nodesOffset = readFixed(plan->data + 24, 8);
+    const quint64 rootNode = readFixed(plan->data + 32, 8);
+
+    const uchar* pos = plan->data + PLAN_HEADER_SIZE;
+    const uchar* end = plan->data + std::min(plan->poolOffset, plan->size);
+
+    if (plan->poolOffset > plan->size || plan->poolSize > plan->size - plan->poolOffset ||
+            plan->nodesOffset > plan->size || rootNode >= plan->size - plan->nodesOffset ||
+            !readString(pos, end, master) || !readString(pos, end, slave) ||
+            (version >= 2 && !readVarint(pos, end, ruleCount))) {
+        if (error)
+            *error = path + " is corrupted";
+        return nullptr;
+    }
+
+    if (rules)
+        rules->clear();
+
+    for (quint64 i = 0; i < ruleCount; ++i) {
+        if (!readString(pos, end, rule)) {
+            if (error)
+                *error = path + " is corrupted";
+            return nullptr;
+        }
+        if (rules)
+            rules->append(rule);
+    }
+
+    return new Ftree(QDir(master), QDir(slave), plan, rootNode);
+}
+
+QString Plan::location(const QDir& master, const QDir& slave) {
+    return Journal::location(master, slave, ".plan");
+}
+
+int Plan::changeCount(quint64 node) const {
+    quint64 count;
+
+    if (node >= size - nodesOffset)
+        return 0;
+
+    const uchar* pos = data + nodesOffset + node;
+
+    if (!readVarint(pos, data + size, count))
+        return 0;
+
+    return int(count);
+}
+
+// Nothing is installed in the tree until the whole node is read, so a
+// damaged node never leaves a truncated list behind
+bool Plan::decode(quint64 node, Ftree* tree) const {
+    std::list<QFileInfo>* lists[3] = {
+        new std::list<QFileInfo>(), new std::list<QFileInfo>(), new std::list<QFileInfo>()
+    };
+    QList<Ftree*> children;
+    const bool valid = read(node, tree, lists, children);
+
+    if (!valid) {
+        for (int l = 0; l < 3; ++l)
+            lists[l]->clear();
+        qDeleteAll(children);
+        children.clear();
+    }
+
+    tree->setDirList(lists[0]);
+    tree->setFileList(lists[1]);
+    tree->setRemList(lists[2]);
+
+    for (auto it = children.begin(); it != children.end(); ++it)
+        tree->addChild(*it);
+
+    return valid;
+}
+
+bool Plan::read(quint64 node, const Ftree* tree, std::list<QFileInfo>* lists[3],
+                QList<Ftree*>& children) const {
+    const QDir* sides[3] = { tree->getMaster(), tree->getMaster(), tree->getSlave() };
+    const uchar* end = data + size;
+    quint64 count, id, child;
+    QString entry;
+
+    if (node >= size - nodesOffset)
+        return false;
+
+    // The node change count is only needed before decoding
+    const uchar* pos = data + nodesOffset + node;
+
+    if (!readVarint(pos, end, count))
+        return false;
+
+    for (int l = 0; l < 3; ++l) {
+        if (!readVarint(pos, end, count))
+            return false;
+
+        for (quint64 i = 0; i < count; ++i) {
+            if (!readVarint(pos, end, id) || !name(id, entry))
+                return false;
+            lists[l]->push_back(QFileInfo(sides[l]->filePath(entry)));
+        }
+    }
+
+    if (!readVarint(pos, end, count))
+        return false;
+
+    for (quint64 i = 0; i < count; ++i) {
+        if (!readVarint(pos, end, id) || !name(id, entry) ||
+                !readVarint(pos, end, child) || child >= size - nodesOffset)
+            return false;
+        children.append(new Ftree(QDir(tree->getMaster()->filePath(entry)),
+                                  QDir(tree->getSlave()->filePath(entry)),
+                                  sharedFromThis(), child));
+    }
+
+    return true;
+}
+
+bool Plan::name(quint64 id, QString& str) const {
+    if (id >= poolSize)
+        return false;
+
+    const uchar* pos = data + poolOffset + id;
+
+    return readString(pos, data + poolOffset + poolSize, str);
+}
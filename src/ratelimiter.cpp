@@ -0,0 +1,130 @@
+/*Copyright 2017 Pierre Franco
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+#include <algorithm>
+#include <QMutexLocker>
+#include <QThread>
+#include "ratelimiter.h"
+
+#ifdef Q_OS_LINUX
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_NONE 0
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+#endif
+
+#define RATE_SLICE_MSECS 100
+
+thread_local int RateLimiter::appliedPriority = 0;
+
+RateLimiter::RateLimiter() {
+    clock.start();
+    byteBucket.tokens = opBucket.tokens = 0;
+    byteBucket.refilled = opBucket.refilled = 0;
+    byteBucket.last = opBucket.last = 0;
+}
+
+RateLimiter& RateLimiter::instance() {
+    static RateLimiter limiter;
+    return limiter;
+}
+
+void RateLimiter::setLimits(qint64 bytesPerSecond, qint64 opsPerSecond) {
+    QMutexLocker locker(&mutex);
+    const qint64 now = clock.nsecsElapsed();
+
+    setRate(byteBucket, std::max<qint64>(bytesPerSecond, 0), now);
+    setRate(opBucket, std::max<qint64>(opsPerSecond, 0), now);
+}
+
+// Threads pick the new priority up on their next acquire
+void RateLimiter::setIdlePriority(bool enabled) {
+    if (idle.fetchAndStoreOrdered(enabled ? 1 : 0) != (enabled ? 1 : 0))
+        priority.fetchAndAddOrdered(1);
+}
+
+// The I/O priority belongs to the calling thread, workers apply it when
+// they start and again whenever it is changed
+void RateLimiter::applyPriority() {
+    appliedPriority = priority.loadAcquire();
+
+#ifdef Q_OS_LINUX
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+            (idle.loadAcquire() ? IOPRIO_CLASS_IDLE : IOPRIO_CLASS_NONE) << IOPRIO_CLASS_SHIFT);
+#endif
+}
+
+// A bucket going from unlimited to limited starts full, otherwise its
+// balance is kept, clamped to the new rate
+void RateLimiter::setRate(Bucket& bucket, qint64 rate, qint64 now) {
+    const qint64 previous = bucket.rate.loadAcquire();
+
+    if (rate > 0 && previous <= 0) {
+        bucket.tokens = rate;
+        bucket.last = now;
+    } else if (rate > 0) {
+        refill(bucket, previous, now);
+        bucket.tokens = std::min(bucket.tokens, double(rate));
+    }
+
+    bucket.rate.storeRelease(rate);
+}
+
+// Unused tokens add up to one second of traffic at most, missing ones are
+// a debt callers sleep off
+void RateLimiter::refill(Bucket& bucket, qint64 rate, qint64 now) {
+    const double added = double(now - bucket.last)*rate/1e9;
+
+    bucket.refilled += added;
+    bucket.tokens = std::min(double(rate), bucket.tokens + added);
+    bucket.last = now;
+}
+
+void RateLimiter::acquire(Bucket& bucket, qint64 amount) {
+    double target;
+    qint64 wait;
+
+    {
+        QMutexLocker locker(&mutex);
+        const qint64 rate = bucket.rate.loadAcquire();
+
+        if (rate <= 0)
+            return;
+
+        refill(bucket, rate, clock.nsecsElapsed());
+        bucket.tokens -= amount;
+
+        // The caller's debt is paid once this much more has been refilled
+        target = bucket.refilled - bucket.tokens;
+        wait = bucket.tokens < 0 ? qint64(-bucket.tokens*1000/rate) + 1 : 0;
+    }
+
+    // Sleep by slices and recompute the wait from the live rate, so that
+    // changing or lifting the limit takes effect at once
+    while (wait > 0) {
+        QThread::msleep(std::min<qint64>(wait, RATE_SLICE_MSECS));
+
+        QMutexLocker locker(&mutex);
+        const qint64 rate = bucket.rate.loadAcquire();
+
+        if (rate <= 0)
+            return;
+
+        refill(bucket, rate, clock.nsecsElapsed());
+        wait = bucket.refilled < target ? qint64((target - bucket.refilled)*1000/rate) + 1 : 0;
+    }
+}
@@ -0,0 +1,99 @@
+/*Copyright 2017 Pierre Franco
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+#include <QDateTime>
+#include <QFileInfo>
+#include <QRegularExpression>
+#include <QStringList>
+#include "snapshot.h"
+
+#define SNAPSHOT_FORMAT "yyyy-MM-dd_hh-mm-ss"
+#define SNAPSHOT_PATTERN "^\\d{4}-\\d{2}-\\d{2}_\\d{2}-\\d{2}-\\d{2}(_\\d+)?"
+#define SNAPSHOT_MAX_TRIES 100
+#define PARTIAL_SUFFIX ".partial"
+
+// Latest complete snapshot of base, empty when there is none. Stamps are
+// in UTC so they sort in chronological order, snapshots made in the same
+// second by their numeric suffix.
+QString Snapshot::previous(const QDir& base) {
+    const QRegularExpression pattern(SNAPSHOT_PATTERN "$");
+    const QStringList names = base.entryList(QDir::Dirs | QDir::NoDotAndDotDot | QDir::NoSymLinks);
+    QString latest, latestStamp;
+    int latestIndex = -1;
+
+    for (auto it = names.begin(); it != names.end(); ++it) {
+        const QRegularExpressionMatch match = pattern.match(*it);
+
+        if (!match.hasMatch())
+            continue;
+
+        const QString stamp = it->left(int(sizeof(SNAPSHOT_FORMAT) - 1));
+        const int index = match.captured(1).mid(1).toInt();
+
+        if (stamp > latestStamp || (stamp == latestStamp && index > latestIndex)) {
+            latest = base.filePath(*it);
+            latestStamp = stamp;
+            latestIndex = index;
+        }
+    }
+
+    return latest;
+}
+
+// Creates the partial folder of a new snapshot, empty on failure
+QString Snapshot::create(const QDir& base) {
+    const QString stamp = QDateTime::currentDateTimeUtc().toString(SNAPSHOT_FORMAT);
+
+    for (int i = 0; i < SNAPSHOT_MAX_TRIES; ++i) {
+        const QString name = i ? stamp + "_" + QString::number(i) : stamp;
+
+        if (!QFileInfo::exists(base.filePath(name)) && base.mkdir(name + PARTIAL_SUFFIX))
+            return base.filePath(name + PARTIAL_SUFFIX);
+    }
+
+    return QString();
+}
+
+bool Snapshot::complete(const QDir& partial) {
+    if (!isPartial(partial))
+        return false;
+
+    return QDir().rename(partial.absolutePath(), completedPath(partial));
+}
+
+// Path a partial snapshot will have once complete
+QString Snapshot::completedPath(const QDir& partial) {
+    const QString path = partial.absolutePath();
+
+    if (!isPartial(partial))
+        return path;
+
+    return path.left(path.size() - int(sizeof(PARTIAL_SUFFIX) - 1));
+}
+
+bool Snapshot::isPartial(const QDir& dir) {
+    const QRegularExpression pattern(SNAPSHOT_PATTERN "\\" PARTIAL_SUFFIX "$");
+
+    return pattern.match(dir.dirName()).hasMatch();
+}
+
+// Snapshots interrupted before completion are never resumed
+void Snapshot::discardPartial(const QDir& base) {
+    const QStringList names = base.entryList(QDir::Dirs | QDir::NoDotAndDotDot | QDir::NoSymLinks);
+
+    for (auto it = names.begin(); it != names.end(); ++it) {
+        if (isPartial(QDir(base.filePath(*it))))
+            QDir(base.filePath(*it)).removeRecursively();
+    }
+}
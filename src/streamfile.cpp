@@ -0,0 +1,178 @@
+/*Copyright 2017 Pierre Franco
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+#include <QMutexLocker>
+#include "streamfile.h"
+
+#ifdef Q_OS_LINUX
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define STREAM_POOL_SIZE 8
+#define STREAM_WINDOW_SIZE (8*1024*1024)
+
+QAtomicInt StreamFile::dropMode;
+QAtomicInt StreamFile::directMode;
+QMutex StreamFile::poolMutex;
+QList<char*> StreamFile::pool;
+
+StreamFile::StreamFile(const QString& path) :
+    handle(path), dropCache(false), direct(false), position(0), submitted(0), flushed(0)
+{}
+
+// Takes effect on the next opened file
+void StreamFile::setCacheMode(bool drop, bool direct) {
+    dropMode.storeRelease(drop ? 1 : 0);
+    directMode.storeRelease(direct ? 1 : 0);
+}
+
+char* StreamFile::acquireBuffer() {
+    {
+        QMutexLocker locker(&poolMutex);
+
+        if (!pool.isEmpty())
+            return pool.takeLast();
+    }
+
+    return static_cast<char*>(qMallocAligned(BufferSize, Alignment));
+}
+
+void StreamFile::releaseBuffer(char* buffer) {
+    {
+        QMutexLocker locker(&poolMutex);
+
+        if (pool.size() < STREAM_POOL_SIZE) {
+            pool.append(buffer);
+            return;
+        }
+    }
+
+    qFreeAligned(buffer);
+}
+
+bool StreamFile::open(QIODevice::OpenMode mode, Access access) {
+    // Reads and writes go straight to the descriptor, at the offsets and
+    // with the lengths given by the caller
+    if (!handle.open(mode | QIODevice::Unbuffered))
+        return false;
+
+    dropCache = dropMode.loadAcquire() || access == Uncached;
+    direct = directMode.loadAcquire() || access == Uncached;
+
+#ifdef Q_OS_LINUX
+    const int fd = handle.handle();
+
+    // The default mode leaves read-ahead to the kernel heuristics
+    if (dropCache || direct)
+        posix_fadvise(fd, 0, 0, access == Random ? POSIX_FADV_RANDOM : POSIX_FADV_SEQUENTIAL);
+
+    // Some filesystems (tmpfs...) refuse direct I/O, they stay cached
+    if (direct)
+        direct = fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT) == 0;
+
+    // Without direct I/O, the cached pages are written and dropped first
+    if (access == Uncached && !direct) {
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+#else
+    Q_UNUSED(access);
+    direct = false;
+#endif
+
+    return true;
+}
+
+bool StreamFile::seek(qint64 offset) {
+    if (!handle.seek(offset))
+        return false;
+
+    position = offset;
+    return true;
+}
+
+qint64 StreamFile::read(char* data, qint64 length) {
+    const qint64 count = handle.read(data, length);
+
+#ifdef Q_OS_LINUX
+    if (count > 0 && dropCache && !direct)
+        posix_fadvise(handle.handle(), position, count, POSIX_FADV_DONTNEED);
+#endif
+
+    if (count > 0)
+        position += count;
+
+    return count;
+}
+
+bool StreamFile::write(const char* data, qint64 length) {
+#ifdef Q_OS_LINUX
+    // Direct writes must fill whole blocks, only the end of a file does not
+    if (direct && length % Alignment != 0) {
+        const int fd = handle.handle();
+
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+        direct = false;
+    }
+#endif
+
+    if (handle.write(data, length) != length)
+        return false;
+
+    position += length;
+    writeBehind(false);
+
+    return true;
+}
+
+// Waits for the written data to reach the disk in the cache-friendly mode,
+// so that its pages can be dropped
+bool StreamFile::finish() {
+    writeBehind(true);
+    return handle.flush();
+}
+
+QFile& StreamFile::file() {
+    return handle;
+}
+
+// Each full window is submitted for writing as soon as it is written, and
+// the window before it, which had time to reach the disk, is waited for
+// and dropped from the cache. Dirty pages never exceed two windows.
+void StreamFile::writeBehind(bool all) {
+#ifdef Q_OS_LINUX
+    if (!dropCache || direct)
+        return;
+
+    const int fd = handle.handle();
+
+    if (all || position - submitted >= STREAM_WINDOW_SIZE) {
+        sync_file_range(fd, submitted, position - submitted, SYNC_FILE_RANGE_WRITE);
+
+        const qint64 end = all ? position : submitted;
+
+        if (end > flushed) {
+            sync_file_range(fd, flushed, end - flushed, SYNC_FILE_RANGE_WAIT_BEFORE |
+                            SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+            posix_fadvise(fd, flushed, end - flushed, POSIX_FADV_DONTNEED);
+            flushed = end;
+        }
+
+        submitted = position;
+    }
+#else
+    Q_UNUSED(all);
+#endif
+}
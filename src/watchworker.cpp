@@ -0,0 +1,435 @@
+/*Copyright 2017 Pierre Franco
+*
+*   Licensed under the Apache License, Version 2.0 (the "License");
+*   you may not use this file except in compliance with the License.
+*   You may obtain a copy of the License at
+*
+*       http://www.apache.org/licenses/LICENSE-2.0
+*
+*   Unless required by applicable law or agreed to in writing, software
+*   distributed under the License is distributed on an "AS IS" BASIS,
+*   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*   See the License for the specific language governing permissions and
+*   limitations under the License.
+*/
+#include <QDir>
+#include <QFile>
+#include <QMap>
+#include <QStringList>
+#include "ratelimiter.h"
+#include "watchworker.h"
+
+#ifdef Q_OS_LINUX
+#include <cerrno>
+#include <climits>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#define WATCH_POLL_MSECS 250
+#define WATCH_QUIET_MSECS 1000
+#define WATCH_MAX_DELAY_MSECS 10000
+#define WATCH_RESCAN_MSECS 60000
+#define WATCH_BUFFER_SIZE 65536
+#define WATCH_HANDLE_CACHE 16384
+#define WATCH_INOTIFY_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | \
+                            IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+#define WATCH_FANOTIFY_MASK (FAN_CREATE | FAN_DELETE | FAN_MODIFY | FAN_CLOSE_WRITE | \
+                             FAN_MOVED_FROM | FAN_MOVED_TO | FAN_ONDIR)
+
+WatchWorker::WatchWorker(const QList<Ftree*>& roots, const Filter* filter) :
+    roots(roots), filter(filter), analyzer(roots, filter), applier(roots, filter), cancel(false),
+    notifyFd(-1), mountFd(-1), fanotify(false)
+{
+    QObject::connect(&analyzer, SIGNAL(itemChanged(QString)), this, SIGNAL(itemChanged(QString)));
+    QObject::connect(&applier, SIGNAL(itemChanged(QString)), this, SIGNAL(itemChanged(QString)));
+}
+
+void WatchWorker::cancelWork() {
+    cancel = true;
+    analyzer.cancelWork();
+    applier.cancelWork();
+}
+
+// Changes are watched before the first full pass, so that those made while
+// it runs are queued by the kernel and synchronized right after it. A lost
+// queue is reported as an overflow, which compares everything again.
+void WatchWorker::run() {
+    QElapsedTimer lastRescan;
+
+    RateLimiter::instance().applyPriority();
+
+    if (!initFanotify())
+        initInotify();
+
+    firstDirty.start();
+    lastEvent.start();
+
+    analyzer.compare(roots);
+    if (cancel) {
+        closeNotify();
+        return;
+    }
+    readEvents();
+    applier.apply(roots);
+    for (auto it = roots.begin(); it != roots.end(); ++it)
+        (*it)->clearChanges();
+    if (cancel) {
+        closeNotify();
+        return;
+    }
+    readEvents();
+
+    if (dirty.isEmpty())
+        emit synchronized();
+    else
+        sync();
+
+    lastRescan.start();
+
+    while (!cancel) {
+#ifdef Q_OS_LINUX
+        struct pollfd events = { notifyFd, POLLIN, 0 };
+
+        if (poll(&events, 1, WATCH_POLL_MSECS) > 0)
+            readEvents();
+#else
+        msleep(WATCH_POLL_MSECS);
+#endif
+
+        if (!unwatched.isEmpty() && lastRescan.elapsed() >= WATCH_RESCAN_MSECS) {
+            rescanUnwatched();
+            lastRescan.restart();
+        }
+
+        // Wait for the source to settle, but never delay a batch too long
+        if (!dirty.isEmpty() && (lastEvent.elapsed() >= WATCH_QUIET_MSECS ||
+                                 firstDirty.elapsed() >= WATCH_MAX_DELAY_MSECS))
+            sync();
+    }
+
+    closeNotify();
+}
+
+void WatchWorker::closeNotify() {
+#ifdef Q_OS_LINUX
+    if (notifyFd >= 0)
+        ::close(notifyFd);
+    if (mountFd >= 0)
+        ::close(mountFd);
+#endif
+    notifyFd = mountFd = -1;
+    handles.clear();
+}
+
+// A filesystem-wide fanotify mark has no watch limit, but needs
+// CAP_SYS_ADMIN and a kernel reporting folder handles (5.9). Mount marks
+// cannot report folder entry events, so the whole filesystem is marked
+// and events outside the source are dropped once their folder is resolved.
+bool WatchWorker::initFanotify() {
+#if defined(Q_OS_LINUX) && defined(FAN_REPORT_DFID_NAME)
+    const QByteArray master = QFile::encodeName(roots.first()->getMaster()->absolutePath());
+
+    notifyFd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK | FAN_REPORT_DFID_NAME,
+                             O_RDONLY);
+    if (notifyFd < 0)
+        return false;
+
+    mountFd = ::open(master.constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (mountFd < 0 || fanotify_mark(notifyFd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+                                     WATCH_FANOTIFY_MASK, AT_FDCWD, master.constData()) != 0) {
+        if (mountFd >= 0)
+            ::close(mountFd);
+        ::close(notifyFd);
+        notifyFd = mountFd = -1;
+        return false;
+    }
+
+    fanotify = true;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void WatchWorker::initInotify() {
+#ifdef Q_OS_LINUX
+    notifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+    addWatches(roots.first()->getMaster()->absolutePath());
+}
+
+void WatchWorker::addWatches(const QString& path) {
+    if (cancel || fanotify)
+        return;
+
+    const QString relative = roots.first()->getMaster()->relativeFilePath(path);
+
+    if (filter && !relative.isEmpty() && relative != "." && filter->excludes(relative, true))
+        return;
+
+#ifdef Q_OS_LINUX
+    const int wd = notifyFd < 0 ? -1 :
+                   inotify_add_watch(notifyFd, QFile::encodeName(path).constData(), WATCH_INOTIFY_MASK);
+
+    if (wd < 0) {
+        // Out of watches: the whole subtree falls back to periodic rescans
+        if (notifyFd < 0 || errno == ENOSPC || errno == ENOMEM)
+            unwatched.insert(path);
+        return;
+    }
+
+    watches.insert(wd, path);
+    RateLimiter::instance().acquireOps();
+
+    const QFileInfoList dirList = QDir(path).entryInfoList(QDir::Dirs |
+                                                           QDir::NoDotAndDotDot | QDir::NoSymLinks);
+
+    for (auto it = dirList.begin(); it != dirList.end(); ++it)
+        addWatches(it->absoluteFilePath());
+#else
+    unwatched.insert(path);
+#endif
+}
+
+void WatchWorker::readEvents() {
+    if (notifyFd < 0)
+        return;
+
+    if (fanotify)
+        readFanotify();
+    else
+        readInotify();
+}
+
+void WatchWorker::readFanotify() {
+#if defined(Q_OS_LINUX) && defined(FAN_REPORT_DFID_NAME)
+    alignas(struct fanotify_event_metadata) char buffer[WATCH_BUFFER_SIZE];
+    const QString master = roots.first()->getMaster()->absolutePath();
+    ssize_t length;
+
+    while ((length = read(notifyFd, buffer, sizeof(buffer))) > 0) {
+        for (struct fanotify_event_metadata* event = reinterpret_cast<struct fanotify_event_metadata*>(buffer);
+             FAN_EVENT_OK(event, length); event = FAN_EVENT_NEXT(event, length)) {
+            if (event->mask & FAN_Q_OVERFLOW) {
+                markDirty(master, true);
+                continue;
+            }
+
+            struct fanotify_event_info_fid* info = reinterpret_cast<struct fanotify_event_info_fid*>(event + 1);
+
+            if (event->event_len < sizeof(*event) + sizeof(*info) ||
+                    (info->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME &&
+                     info->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID))
+                continue;
+
+            struct file_handle* handle = reinterpret_cast<struct file_handle*>(info->handle);
+            const QByteArray key(reinterpret_cast<const char*>(handle), int(sizeof(*handle) + handle->handle_bytes));
+            auto it = handles.constFind(key);
+            QString dir;
+
+            if (it != handles.constEnd()) {
+                dir = it.value();
+            } else {
+                // Each folder is resolved once, an empty path stands for
+                // one outside the source or excluded
+                const int fd = open_by_handle_at(mountFd, handle, O_PATH | O_CLOEXEC);
+
+                if (fd < 0) {
+                    // Resolving handles also needs CAP_DAC_READ_SEARCH
+                    if (errno == EPERM) {
+                        closeNotify();
+                        fanotify = false;
+                        initInotify();
+                        markDirty(master, true);
+                        return;
+                    }
+                    continue;
+                }
+
+                char path[PATH_MAX];
+                const ssize_t size = readlink(("/proc/self/fd/" + QByteArray::number(fd)).constData(),
+                                              path, sizeof(path));
+                ::close(fd);
+
+                if (size <= 0)
+                    continue;
+
+                dir = QFile::decodeName(QByteArray(path, int(size)));
+
+                if ((dir != master && !dir.startsWith(master + "/")) || isExcluded(dir))
+                    dir.clear();
+
+                if (handles.size() >= WATCH_HANDLE_CACHE)
+                    handles.clear();
+                handles.insert(key, dir);
+            }
+
+            // A moved or removed folder invalidates the paths below it
+            if ((event->mask & FAN_ONDIR) && (event->mask & (FAN_MOVED_FROM | FAN_MOVED_TO | FAN_DELETE)))
+                handles.clear();
+
+            if (dir.isEmpty())
+                continue;
+
+            if (info->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME) {
+                const char* name = reinterpret_cast<const char*>(handle->f_handle + handle->handle_bytes);
+
+                if (isExcluded(dir + "/" + QFile::decodeName(name), event->mask & FAN_ONDIR))
+                    continue;
+            }
+
+            markDirty(dir, false);
+        }
+    }
+#endif
+}
+
+void WatchWorker::readInotify() {
+#ifdef Q_OS_LINUX
+    alignas(struct inotify_event) char buffer[WATCH_BUFFER_SIZE];
+    ssize_t length;
+
+    while ((length = read(notifyFd, buffer, sizeof(buffer))) > 0) {
+        for (char* pos = buffer; pos < buffer + length;) {
+            const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(pos);
+
+            pos += sizeof(struct inotify_event) + event->len;
+
+            // Events were lost: compare everything and watch new folders
+            if (event->mask & IN_Q_OVERFLOW) {
+                markDirty(roots.first()->getMaster()->absolutePath(), true);
+                addWatches(roots.first()->getMaster()->absolutePath());
+                continue;
+            }
+
+            auto it = watches.find(event->wd);
+
+            if (it == watches.end())
+                continue;
+
+            if (event->mask & IN_IGNORED) {
+                watches.erase(it);
+                continue;
+            }
+
+            const QString dir = it.value();
+
+            // Excluded folders are not watched, but excluded entries of a
+            // watched one still report their changes
+            if (event->len > 0 && isExcluded(dir + "/" + QFile::decodeName(event->name), event->mask & IN_ISDIR))
+                continue;
+
+            if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO)) && event->len > 0)
+                addWatches(dir + "/" + QFile::decodeName(event->name));
+
+            markDirty(dir, false);
+        }
+    }
+#endif
+}
+
+// A folder is excluded when any folder on its way from the source is
+bool WatchWorker::isExcluded(const QString& path, bool isDir) const {
+    const QString relative = roots.first()->getMaster()->relativeFilePath(path);
+
+    if (!filter || relative.isEmpty() || relative == ".")
+        return false;
+
+    for (int pos = relative.indexOf('/'); pos >= 0; pos = relative.indexOf('/', pos + 1)) {
+        if (filter->excludes(relative.left(pos), true))
+            return true;
+    }
+
+    return filter->excludes(relative, isDir);
+}
+
+void WatchWorker::markDirty(const QString& path, bool full) {
+    if (dirty.isEmpty())
+        firstDirty.restart();
+    lastEvent.restart();
+
+    dirty.insert(path, dirty.value(path, false) || full);
+}
+
+void WatchWorker::rescanUnwatched() {
+    const QList<QString> paths = unwatched.values();
+
+    unwatched.clear();
+
+    for (auto it = paths.begin(); it != paths.end(); ++it) {
+        markDirty(*it, true);
+        addWatches(*it);
+    }
+}
+
+void WatchWorker::sync() {
+    QStringList paths = dirty.keys();
+
+    paths.sort();
+
+    for (auto it = paths.begin(); it != paths.end(); ++it) {
+        QMap<QString, QList<Ftree*>> groups;
+
+        // Destinations may not know the same folders yet, nodes are
+        // grouped by the master folder they stand for
+        for (auto rit = roots.begin(); rit != roots.end(); ++rit) {
+            Ftree* node = findNode(*rit, *it);
+
+            if (node)
+                groups[node->getMaster()->absolutePath()].append(node);
+        }
+
+        for (auto git = groups.begin(); git != groups.end(); ++git) {
+            if (cancel)
+                return;
+
+            emit itemChanged("Synchronizing folder " + git.key());
+            analyzer.compare(git.value(), dirty.value(*it));
+            if (cancel)
+                return;
+            applier.apply(git.value());
+            for (auto nit = git.value().begin(); nit != git.value().end(); ++nit)
+                (*nit)->clearChanges();
+        }
+    }
+
+    dirty.clear();
+    emit synchronized();
+}
+
+// Deepest node on the way to path: a folder not known yet is handled by
+// comparing its closest known parent
+Ftree* WatchWorker::findNode(Ftree* root, const QString& path) const {
+    const QString relative = root->getMaster()->relativeFilePath(path);
+
+    if (relative == ".." || relative.startsWith("../"))
+        return nullptr;
+
+    const QStringList names = relative.split('/');
+    Ftree* node = root;
+
+    for (auto it = names.begin(); it != names.end() && *it != "."; ++it) {
+        Ftree* next = nullptr;
+
+        if (it->isEmpty())
+            continue;
+
+        for (auto cit = node->getChildren()->begin(); cit != node->getChildren()->end(); ++cit) {
+            if ((*cit)->getMaster()->dirName() == *it) {
+                next = *cit;
+                break;
+            }
+        }
+
+        if (!next)
+            break;
+        node = next;
+    }
+
+    return node;
+}